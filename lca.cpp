@@ -23,180 +23,1980 @@
 #include <iostream>
 #include <cmath>
 #include <vector>
-#include <list>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <cerrno>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <chrono>
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
-/// Fit 40000 in 2 bytes
-typedef unsigned short int small_int;
+/// Node indices are stored in integers picked by node count: 16 bits
+/// for up to 65535 nodes (fits 40000), 32 or 64 bits for larger
+/// trees. Edge lengths are picked independently: 32 bits, or 64 bits
+/// with --wide-lengths (see main).
+typedef unsigned short int small_int;
+typedef unsigned int medium_int;
+typedef unsigned long long int large_int;
+
+/// We use 64-bit integers for distances, which fit 40000×39999 and
+/// sums of 2^32 edges 2^32 long.
+typedef unsigned long long int distance_int;
+
+/// Tree graph built with add_edge. Base of LCA engines, which
+/// preprocess it with a depth-first traversal.
+template <class Index, class Weight>
+class TreeGraph
+{
+public:
+    typedef Index index_t;
+    typedef Weight weight_t;
+
+protected:
+    /// Edge as added with add_edge
+    struct Edge
+    {
+        Index v1, v2;
+        Weight length;
+
+        Edge(Index a, Index b, Weight l)
+            :v1(a), v2(b), length(l)
+        {}
+    };
+
+    /// Half of edge stored with its start vertex
+    struct Arc
+    {
+        Index to;
+        Weight length;
+    };
+
+    /// Vertex count
+    Index size;
+
+    /// Edges added but not yet moved to adjacency arrays
+    vector<Edge> edges;
+
+    /// Adjacency in compressed sparse row form: arcs of vertex v are
+    /// arcs[offsets[v]] to arcs[offsets[v + 1] - 1], in order edges
+    /// were added. Built from edges when traversal starts, so every
+    /// vertex has its arcs in one contiguous block.
+    vector<size_t> offsets;
+    vector<Arc> arcs;
+
+    /// Vertex on DFS stack with its parent and position in arcs.
+    struct Frame
+    {
+        Index v, p;
+        size_t i;
+
+        Frame(Index vertex, Index parent, size_t first)
+            :v(vertex), p(parent), i(first)
+        {}
+    };
+
+    /// Move added edges to adjacency arrays.
+    void build_adjacency(void)
+    {
+        /// Count arcs of every vertex, turn counts into block ends
+        /// and fill blocks backwards, which leaves block starts in
+        /// offsets.
+        offsets.assign(size + 1, 0);
+        for (typename vector<Edge>::const_iterator e = edges.begin(); e != edges.end(); e++)
+        {
+            offsets[e->v1]++;
+            offsets[e->v2]++;
+        }
+        for (size_t v = 1; v <= size; v++)
+            offsets[v] += offsets[v - 1];
+
+        arcs.resize(offsets[size]);
+        for (typename vector<Edge>::const_reverse_iterator e = edges.rbegin();
+             e != edges.rend(); e++)
+        {
+            Arc &a1 = arcs[--offsets[e->v1]];
+            a1.to = e->v2;
+            a1.length = e->length;
+            Arc &a2 = arcs[--offsets[e->v2]];
+            a2.to = e->v1;
+            a2.length = e->length;
+        }
+        vector<Edge>().swap(edges);
+    }
+
+    /// Traverse tree from root v, calling visitor.enter(u, p, d)
+    /// when vertex u is reached from parent p by edge of length d
+    /// (root is its own parent) and visitor.leave(u) when its
+    /// subtree is done. Stack is kept explicitly, so that depth of
+    /// tree is only limited by memory.
+    template <class Visitor>
+    void dfs(Index v, Visitor &visitor)
+    {
+        if (!edges.empty() || offsets.empty())
+            build_adjacency();
+
+        vector<Frame> stack;
+        visitor.enter(v, v, 0);
+        stack.push_back(Frame(v, v, offsets[v]));
+
+        while (!stack.empty())
+        {
+            Frame &f = stack.back();
+            if (f.i == offsets[f.v + 1])
+            {
+                visitor.leave(f.v);
+                stack.pop_back();
+                continue;
+            }
+
+            /// The only neighbour visited before is the parent, as
+            /// graph is a tree.
+            const Arc &a = arcs[f.i++];
+            if ((a.to != f.p) || (f.v == f.p))
+            {
+                visitor.enter(a.to, f.v, a.length);
+                stack.push_back(Frame(a.to, f.v, offsets[a.to]));
+            }
+        }
+    }
+
+public:
+    TreeGraph(Index n)
+        :size(n)
+    {
+        if (n > 0)
+            edges.reserve(n - 1);
+    }
+
+    /// Add edge from v1 to v2 with given length
+    void add_edge(Index v1, Index v2, Weight length)
+    {
+        edges.push_back(Edge(v1, v2, length));
+    }
+};
+
+/// Tree class
+///
+/// Implements LCA algorithm with binary lifting to calculate distance
+/// between two nodes using Tree::find_distance() method. Index is
+/// type of node indices and Weight is type of edge lengths.
+///
+/// Tables are indexed by DFS preorder numbers of nodes rather than
+/// by nodes, so subtrees and nearby ancestors occupy nearby rows.
+/// Subtree of node numbered a holds numbers a to last[a].
+template <class Index, class Weight>
+class Tree : public TreeGraph<Index, Weight>
+{
+    friend class TreeGraph<Index, Weight>;
+
+private:
+    /// Binary logarithm of size (rounded up)
+    Index levels;
+
+    /// Preorder number of every node and node of every number
+    vector<Index> number, vertex;
+
+    /// Last number in subtree of every number
+    vector<Index> last;
+
+    /// DFS timer
+    Index timer;
+
+    /// Numbers of 2^j-th ancestors: levels entries per number, in
+    /// one flat table.
+    vector<Index> anc;
+
+    /// Distance from root to every number
+    vector<distance_int> root_dist;
+
+    /// Enter v with p as parent
+    void enter(Index v, Index p, Weight p_dist)
+    {
+        Index i = timer++;
+        number[v] = i;
+        vertex[i] = v;
+
+        Index *a = &anc[(size_t)i * levels];
+        a[0] = number[p];
+        root_dist[i] = root_dist[number[p]] + p_dist;
+
+        for (Index j = 1; j < levels; j++)
+            a[j] = anc[(size_t)a[j - 1] * levels + j - 1];
+    }
+
+    void leave(Index v)
+    {
+        last[number[v]] = timer - 1;
+    }
+
+    /// Return true if number a is a proper ancestor of b
+    bool is_ancestor_number(Index a, Index b) const
+    {
+        return (a < b) && (b <= last[a]);
+    }
+
+    /// Find number of LCA of numbers a and b
+    Index lca_number(Index a, Index b) const
+    {
+        if ((a == b) || is_ancestor_number(a, b))
+            return a;
+        if (is_ancestor_number(b, a))
+            return b;
+
+        const Index *row = &anc[(size_t)a * levels];
+        for (int j = levels - 1; j >= 0; j--)
+            if (!is_ancestor_number(row[j], b))
+                row = &anc[(size_t)row[j] * levels];
+        return row[0];
+    }
+
+public:
+    Tree(Index n)
+        :TreeGraph<Index, Weight>(n), number(n, 0), vertex(n, 0), last(n, 0)
+    {
+        levels = (n != 1) ? ceil(log(n) / log(2)) : 1;
+    }
+
+    void lca_preprocess(void)
+    {
+        anc.assign((size_t)this->size * levels, 0);
+        root_dist.assign(this->size, 0);
+        timer = 0;
+        this->dfs(0, *this);
+    }
+
+    /// Return true if v1 is ancestor of v2
+    bool is_ancestor(Index v1, Index v2) const
+    {
+        return is_ancestor_number(number[v1], number[v2]);
+    }
+
+    /// Find LCA of two vertices
+    Index find_lca(Index v1, Index v2) const
+    {
+        return vertex[lca_number(number[v1], number[v2])] + 1;
+    }
+
+    /// Find distance between two vertices
+    distance_int find_distance(Index v1, Index v2) const
+    {
+        Index a = number[v1], b = number[v2];
+        return root_dist[a] + root_dist[b] - 2 * root_dist[lca_number(a, b)];
+    }
+};
+
+/// Write whole buffer to file descriptor.
+bool write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+/// Replace file at path with given contents, so that either old or
+/// new contents survive a crash.
+bool replace_file(const string &path, const char *data, size_t length)
+{
+    string temp = path + ".tmp";
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = write_all(fd, data, length) && (fsync(fd) == 0);
+    ok = (::close(fd) == 0) && ok;
+    if (!ok || (rename(temp.c_str(), path.c_str()) != 0))
+    {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/// Read-only shared memory mapping of whole file.
+class MappedFile
+{
+private:
+    void *mapping;
+    size_t mapping_size;
+
+public:
+    MappedFile(void)
+        :mapping(NULL), mapping_size(0)
+    {}
+
+    ~MappedFile(void)
+    {
+        close();
+    }
+
+    bool open(const char *path)
+    {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        mapping_size = st.st_size;
+        mapping = mmap(NULL, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            mapping = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    void close(void)
+    {
+        if (mapping != NULL)
+            munmap(mapping, mapping_size);
+        mapping = NULL;
+        mapping_size = 0;
+    }
+
+    const char* data(void) const
+    {
+        return (const char*)mapping;
+    }
+
+    size_t size(void) const
+    {
+        return mapping_size;
+    }
+};
+
+/// Header of preprocessed EulerTree index. Header is followed by root
+/// distance of every vertex, preorder number of every vertex, vertex
+/// of every number and sparse table rows, one after another.
+struct IndexHeader
+{
+    char magic[8];
+
+    /// Vertex count
+    unsigned long long size;
+
+    /// Size of node indices and distances (guards against indices
+    /// built on an incompatible platform)
+    unsigned short index_size, distance_size;
+};
+
+const char index_magic[8] = {'L', 'C', 'A', 'I', 'N', 'D', 'X', '1'};
+
+/// LCA engine answering queries in constant time.
+///
+/// Vertices are numbered in DFS preorder. For vertices u and v with
+/// preorder numbers a < b, LCA is the parent with least number among
+/// parents of vertices numbered a + 1 to b (that is, the last vertex
+/// on the path from root to v whose subtree doesn't contain u). This
+/// is range minimum of the Euler tour restricted to first visits, so
+/// sparse table over it needs n log n entries instead of 2n log 2n
+/// for the full tour, and compares numbers without looking up depths.
+///
+/// Distances are root distance sums: d(u) + d(v) - 2 d(LCA).
+///
+/// All tables are laid out in one image (see IndexHeader), which save
+/// writes to a file and load maps back without preprocessing.
+template <class Index, class Weight>
+class EulerTree : public TreeGraph<Index, Weight>
+{
+    friend class TreeGraph<Index, Weight>;
+
+protected:
+    /// Index image if tree was preprocessed in memory
+    vector<char> buffer;
+
+    /// Mapped index file (read only)
+    MappedFile file;
+
+    /// Distance from root to every vertex
+    distance_int *root_dist;
+
+    /// Preorder number of every vertex and vertex of every number
+    Index *number, *vertex;
+
+    /// Sparse table: row j holds minimum of parent numbers over
+    /// ranges of 2^j vertices, starting with each number.
+    vector<Index*> table;
+
+    Index timer;
+
+    /// Number of sparse table rows for n vertices
+    static int row_count(size_t n)
+    {
+        return (n > 0) ? 64 - __builtin_clzll(n) : 0;
+    }
+
+    /// Size of index image for n vertices
+    static size_t image_size(size_t n)
+    {
+        size_t s = sizeof(IndexHeader) + n * sizeof(distance_int) + 2 * n * sizeof(Index);
+        for (int j = 0; j < row_count(n); j++)
+            s += (n - ((size_t)1 << j) + 1) * sizeof(Index);
+        return s;
+    }
+
+    /// Validate index image and set up pointers to its tables.
+    bool attach(const char *image, size_t size)
+    {
+        const IndexHeader *h = (const IndexHeader*)image;
+        if ((size < sizeof(IndexHeader)) ||
+            !equal(index_magic, index_magic + 8, h->magic) ||
+            (h->index_size != sizeof(Index)) ||
+            (h->distance_size != sizeof(distance_int)) ||
+            (h->size > (Index)~0) ||
+            (size != image_size(h->size)))
+            return false;
+
+        size_t n = h->size;
+        this->size = n;
+        root_dist = (distance_int*)(image + sizeof(IndexHeader));
+        number = (Index*)(root_dist + n);
+        vertex = number + n;
+        table.clear();
+        Index *row = vertex + n;
+        for (int j = 0; j < row_count(n); j++)
+        {
+            table.push_back(row);
+            row += n - ((size_t)1 << j) + 1;
+        }
+        return true;
+    }
+
+    void enter(Index v, Index p, Weight p_dist)
+    {
+        number[v] = timer;
+        vertex[timer] = v;
+        table[0][timer] = number[p];
+        root_dist[v] = root_dist[p] + p_dist;
+        timer++;
+    }
+
+    void leave(Index)
+    {}
+
+    /// Find preorder number of LCA of vertices with numbers a < b.
+    Index range_min(Index a, Index b) const
+    {
+        /// Range a + 1 to b of length b - a
+        int j = 63 - __builtin_clzll((unsigned long long)(b - a));
+        return min(table[j][a + 1], table[j][b + 1 - ((Index)1 << j)]);
+    }
+
+public:
+    EulerTree(Index n)
+        :TreeGraph<Index, Weight>(n), root_dist(NULL), number(NULL), vertex(NULL)
+    {}
+
+    void lca_preprocess(void)
+    {
+        /// Release edge list before allocating the image
+        this->build_adjacency();
+
+        Index n = this->size;
+        buffer.assign(image_size(n), 0);
+        IndexHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, index_magic, sizeof(h.magic));
+        h.size = n;
+        h.index_size = sizeof(Index);
+        h.distance_size = sizeof(distance_int);
+        memcpy(&buffer[0], &h, sizeof(h));
+        attach(&buffer[0], buffer.size());
+
+        timer = 0;
+        this->dfs(0, *this);
+
+        for (size_t j = 1; j < table.size(); j++)
+        {
+            Index half = (Index)1 << (j - 1);
+            const Index *prev = table[j - 1];
+            Index *row = table[j];
+            for (Index i = 0; i < n - 2 * half + 1; i++)
+                row[i] = min(prev[i], prev[i + half]);
+        }
+    }
+
+    /// Write index of preprocessed tree to file.
+    bool save(const string &path) const
+    {
+        return !buffer.empty() && replace_file(path, &buffer[0], buffer.size());
+    }
+
+    /// Map index written by save instead of preprocessing. Tables
+    /// stay in page cache shared by all processes mapping the file.
+    bool load(const char *path)
+    {
+        vector<char>().swap(buffer);
+        return file.open(path) && attach(file.data(), file.size());
+    }
+
+    /// Find LCA of two vertices
+    Index find_lca(Index v1, Index v2) const
+    {
+        Index a = number[v1], b = number[v2];
+        if (a == b)
+            return v1 + 1;
+        return vertex[(a < b) ? range_min(a, b) : range_min(b, a)] + 1;
+    }
+
+    /// Find distance between two vertices
+    distance_int find_distance(Index v1, Index v2) const
+    {
+        Index lca = find_lca(v1, v2) - 1;
+        return root_dist[v1] + root_dist[v2] - 2 * root_dist[lca];
+    }
+};
+
+/// Binary indexed tree over values 0 to n - 1, adding to prefixes
+/// and ranges in O(log n). Value is unsigned, so that negative deltas
+/// wrap around and cancel out in sums.
+template <class Value>
+class FenwickTree
+{
+private:
+    vector<Value> sums;
+
+public:
+    FenwickTree(size_t n = 0)
+        :sums(n + 1, 0)
+    {}
+
+    /// Add x to value i
+    void add(size_t i, Value x)
+    {
+        for (i++; i < sums.size(); i += i & -i)
+            sums[i] += x;
+    }
+
+    /// Add x to values a to b
+    void add(size_t a, size_t b, Value x)
+    {
+        add(a, x);
+        add(b + 1, -x);
+    }
+
+    /// Sum of values 0 to i
+    Value sum(size_t i) const
+    {
+        Value s = 0;
+        for (i++; i > 0; i -= i & -i)
+            s += sums[i];
+        return s;
+    }
+};
+
+/// LCA engine allowing edge lengths to change between queries.
+///
+/// Topology is fixed, so LCA is found with EulerTree tables. Changing
+/// length of edge from p to its child v by delta changes root distance
+/// of every vertex in subtree of v, which holds preorder numbers
+/// number[v] to last[number[v]]. Such changes are kept in a Fenwick
+/// tree over preorder numbers with range add and point query, so
+/// that both update_edge and find_distance take O(log n).
+template <class Index, class Weight>
+class DynamicTree : public EulerTree<Index, Weight>
+{
+private:
+    /// Last number in subtree of every number
+    vector<Index> last;
+
+    /// Current length of edge from every vertex to its parent
+    vector<Weight> length;
+
+    /// Changes of root distances since preprocessing, by number
+    FenwickTree<distance_int> delta;
+
+    /// Number of parent of number i
+    Index parent_number(Index i) const
+    {
+        return this->table[0][i];
+    }
+
+    /// Current distance from root to vertex v
+    distance_int root_distance(Index v) const
+    {
+        return this->root_dist[v] + delta.sum(this->number[v]);
+    }
+
+public:
+    DynamicTree(Index n)
+        :EulerTree<Index, Weight>(n)
+    {}
+
+    void lca_preprocess(void)
+    {
+        EulerTree<Index, Weight>::lca_preprocess();
+
+        Index n = this->size;
+        delta = FenwickTree<distance_int>(n);
+        length.assign(n, 0);
+        last.resize(n);
+        for (size_t i = 0; i < n; i++)
+            last[i] = i;
+
+        /// Children have greater numbers than their parents, so
+        /// subtree ends are final when numbers are seen backwards.
+        for (size_t i = n; i-- > 1;)
+        {
+            Index p = parent_number(i);
+            last[p] = max(last[p], last[i]);
+            Index v = this->vertex[i];
+            length[v] = this->root_dist[v] - this->root_dist[this->vertex[p]];
+        }
+    }
+
+    /// Set length of edge between v1 and v2.
+    ///
+    /// @return false if there's no such edge.
+    bool update_edge(Index v1, Index v2, Weight l)
+    {
+        Index a = this->number[v1], b = this->number[v2];
+        if ((a != b) && (parent_number(a) == b))
+            swap(a, b), swap(v1, v2);
+        else if ((a == b) || (parent_number(b) != a))
+            return false;
+
+        delta.add(b, last[b], (distance_int)l - length[v2]);
+        length[v2] = l;
+        return true;
+    }
+
+    /// Find distance between two vertices
+    distance_int find_distance(Index v1, Index v2) const
+    {
+        Index lca = this->find_lca(v1, v2) - 1;
+        return root_distance(v1) + root_distance(v2) - 2 * root_distance(lca);
+    }
+};
+
+/// Fully dynamic LCA engine: link-cut tree over a rooted forest
+/// whose edges are added, removed and changed between queries, each
+/// operation in amortized O(log n).
+///
+/// Every vertex and every edge is a node of represented forest: edge
+/// from p to its child v is a node between them holding its length,
+/// and vertex nodes hold zero, so length sums over paths are
+/// distances. Forest is split into preferred paths, each kept in a
+/// splay tree ordered by depth. Parent of root of a splay tree is the
+/// parent of the topmost node of its path (path parent). Node is
+/// type of node indices, which must fit 2 size - 1 nodes.
+///
+/// LCA is taken with respect to roots of trees. add_edge builds one
+/// tree rooted at vertex 0, cut makes the child vertex a new root and
+/// link reroots tree of its first vertex at that vertex.
+template <class Index, class Weight, class Node>
+class LinkCutTree : public TreeGraph<Index, Weight>
+{
+    friend class TreeGraph<Index, Weight>;
+
+private:
+    struct SplayNode
+    {
+        /// Children in splay tree and parent or path parent
+        Node child[2], parent;
+
+        /// Sum of lengths in splay subtree
+        distance_int sum;
+
+        Weight length;
+
+        /// Subtree is to be mirrored (its path reversed)
+        bool flip;
+    };
+
+    static const Node none = (Node)~(Node)0;
+
+    /// Vertices are nodes 0 to size - 1, edges use the rest
+    vector<SplayNode> nodes;
+
+    /// Edge nodes not in forest
+    vector<Node> free_edges;
+
+    /// Nodes from splayed node up to root of its splay tree
+    vector<Node> path;
+
+    void enter(Index v, Index p, Weight p_dist)
+    {
+        if (v == p)
+            return;
+
+        Node e = free_edges.back();
+        free_edges.pop_back();
+        nodes[e].length = p_dist;
+        nodes[e].sum = p_dist;
+        nodes[e].parent = p;
+        nodes[v].parent = e;
+    }
+
+    void leave(Index)
+    {}
+
+    bool is_root(Node x) const
+    {
+        Node p = nodes[x].parent;
+        return (p == none) || ((nodes[p].child[0] != x) && (nodes[p].child[1] != x));
+    }
+
+    void update(Node x)
+    {
+        SplayNode &n = nodes[x];
+        n.sum = n.length;
+        for (int d = 0; d < 2; d++)
+            if (n.child[d] != none)
+                n.sum += nodes[n.child[d]].sum;
+    }
+
+    /// Apply pending flip of x to its children
+    void push(Node x)
+    {
+        SplayNode &n = nodes[x];
+        if (!n.flip)
+            return;
+        swap(n.child[0], n.child[1]);
+        for (int d = 0; d < 2; d++)
+            if (n.child[d] != none)
+                nodes[n.child[d]].flip ^= true;
+        n.flip = false;
+    }
+
+    /// Move x above its parent in splay tree
+    void rotate(Node x)
+    {
+        Node p = nodes[x].parent, g = nodes[p].parent;
+        int d = (nodes[p].child[1] == x);
+        if (!is_root(p))
+            nodes[g].child[nodes[g].child[1] == p] = x;
+        nodes[x].parent = g;
+
+        Node c = nodes[x].child[!d];
+        nodes[p].child[d] = c;
+        if (c != none)
+            nodes[c].parent = p;
+        nodes[x].child[!d] = p;
+        nodes[p].parent = x;
+        update(p);
+        update(x);
+    }
+
+    /// Make x root of its splay tree
+    void splay(Node x)
+    {
+        path.clear();
+        for (Node y = x; ; y = nodes[y].parent)
+        {
+            path.push_back(y);
+            if (is_root(y))
+                break;
+        }
+        while (!path.empty())
+        {
+            push(path.back());
+            path.pop_back();
+        }
+
+        while (!is_root(x))
+        {
+            Node p = nodes[x].parent;
+            if (!is_root(p))
+            {
+                Node g = nodes[p].parent;
+                bool zigzig = ((nodes[g].child[0] == p) == (nodes[p].child[0] == x));
+                rotate(zigzig ? p : x);
+            }
+            rotate(x);
+        }
+    }
+
+    /// Make path from root to x preferred, leaving x root of its
+    /// splay tree with no deeper nodes in it.
+    ///
+    /// @return Last node where path parent was followed, which is
+    /// LCA of x and the node accessed before.
+    Node access(Node x)
+    {
+        Node last = none;
+        for (Node y = x; y != none; y = nodes[y].parent)
+        {
+            splay(y);
+            nodes[y].child[1] = last;
+            update(y);
+            last = y;
+        }
+        splay(x);
+        return last;
+    }
+
+    /// Make x root of its tree
+    void evert(Node x)
+    {
+        access(x);
+        nodes[x].flip ^= true;
+    }
+
+    Node find_root(Node x)
+    {
+        access(x);
+        for (push(x); nodes[x].child[0] != none; push(x))
+            x = nodes[x].child[0];
+        splay(x);
+        return x;
+    }
+
+    /// Parent of x in forest, or none for roots
+    Node parent_of(Node x)
+    {
+        access(x);
+        Node y = nodes[x].child[0];
+        if (y == none)
+            return none;
+        for (push(y); nodes[y].child[1] != none; push(y))
+            y = nodes[y].child[1];
+        splay(y);
+        return y;
+    }
+
+    /// Detach x from its parent
+    void cut_parent(Node x)
+    {
+        access(x);
+        Node y = nodes[x].child[0];
+        if (y != none)
+        {
+            nodes[y].parent = none;
+            nodes[x].child[0] = none;
+            update(x);
+        }
+    }
+
+    /// Find node of edge between v1 and v2 and make its child vertex
+    /// first.
+    ///
+    /// @return none if there's no such edge.
+    Node find_edge(Index &v1, Index &v2)
+    {
+        for (int i = 0; i < 2; i++, swap(v1, v2))
+        {
+            Node e = parent_of(v1);
+            if ((e != none) && (parent_of(e) == v2))
+                return e;
+        }
+        return none;
+    }
+
+public:
+    LinkCutTree(Index n)
+        :TreeGraph<Index, Weight>(n)
+    {
+        SplayNode blank = {{none, none}, none, 0, 0, false};
+        nodes.assign(n > 0 ? 2 * (size_t)n - 1 : 0, blank);
+        for (size_t e = nodes.size(); e-- > n;)
+            free_edges.push_back(e);
+    }
+
+    /// Build forest from added edges.
+    void lca_preprocess(void)
+    {
+        if (this->size > 0)
+            this->dfs(0, *this);
+        vector<size_t>().swap(this->offsets);
+        vector<typename TreeGraph<Index, Weight>::Arc>().swap(this->arcs);
+    }
+
+    bool connected(Index v1, Index v2)
+    {
+        return (v1 == v2) || (find_root(v1) == find_root(v2));
+    }
+
+    /// Add edge between vertices of different trees, making v1 a
+    /// child of v2.
+    ///
+    /// @return false if vertices are already connected.
+    bool link(Index v1, Index v2, Weight length)
+    {
+        if (connected(v1, v2))
+            return false;
+
+        Node e = free_edges.back();
+        free_edges.pop_back();
+        nodes[e].length = length;
+        update(e);
+
+        evert(v1);
+        nodes[v1].parent = e;
+        nodes[e].parent = v2;
+        return true;
+    }
+
+    /// Remove edge between v1 and v2.
+    ///
+    /// @return false if there's no such edge.
+    bool cut(Index v1, Index v2)
+    {
+        Node e = find_edge(v1, v2);
+        if (e == none)
+            return false;
+
+        cut_parent(v1);
+        cut_parent(e);
+        free_edges.push_back(e);
+        return true;
+    }
+
+    /// Set length of edge between v1 and v2.
+    ///
+    /// @return false if there's no such edge.
+    bool update_edge(Index v1, Index v2, Weight length)
+    {
+        Node e = find_edge(v1, v2);
+        if (e == none)
+            return false;
+
+        access(e);
+        nodes[e].length = length;
+        update(e);
+        return true;
+    }
+
+    /// Find LCA of two vertices, or 0 if they aren't connected.
+    Index find_lca(Index v1, Index v2)
+    {
+        if (!connected(v1, v2))
+            return 0;
+        access(v1);
+        return access(v2) + 1;
+    }
+
+    /// Find distance between two connected vertices
+    distance_int find_distance(Index v1, Index v2)
+    {
+        access(v1);
+        distance_int d1 = nodes[v1].sum;
+        Node lca = access(v2);
+        distance_int d2 = nodes[v2].sum;
+        access(lca);
+        return d1 + d2 - 2 * nodes[lca].sum;
+    }
+};
+
+/// Offline LCA engine: Tarjan's algorithm answers a set of queries
+/// known in advance with a single DFS and union-find over vertices,
+/// in O(n + q) memory and nearly linear time.
+///
+/// When vertex u is left, all queries (u, w) with w already left are
+/// answered: LCA is the ancestor assigned to set of w, which is the
+/// deepest vertex on the path from root to u whose subtree holds w.
+/// Then the subtree of u joins set of its parent.
+template <class Index, class Weight>
+class OfflineTree : public TreeGraph<Index, Weight>
+{
+    friend class TreeGraph<Index, Weight>;
+
+private:
+    /// Union-find forest over vertices (set representatives point to
+    /// themselves) and size of every set
+    vector<Index> set_parent, set_size;
+
+    /// Vertex assigned to every set representative
+    vector<Index> ancestor;
+
+    vector<Index> parent;
+    vector<distance_int> root_dist;
+    vector<bool> left;
+
+    /// Queries of every vertex v are queries[query_first[v]] to
+    /// queries[query_first[v + 1] - 1]
+    vector<size_t> query_first, query_ids;
+    const vector< pair<Index, Index> > *queries;
+    vector<distance_int> *results;
+
+    Index find(Index v)
+    {
+        Index r = v;
+        while (set_parent[r] != r)
+            r = set_parent[r];
+        /// Compress path
+        while (set_parent[v] != r)
+        {
+            Index next = set_parent[v];
+            set_parent[v] = r;
+            v = next;
+        }
+        return r;
+    }
+
+    /// Join sets of u and v and assign vertex a to the result.
+    void unite(Index u, Index v, Index a)
+    {
+        u = find(u);
+        v = find(v);
+        if (u != v)
+        {
+            if (set_size[u] < set_size[v])
+                swap(u, v);
+            set_parent[v] = u;
+            set_size[u] += set_size[v];
+        }
+        ancestor[u] = a;
+    }
+
+    void enter(Index v, Index p, Weight p_dist)
+    {
+        parent[v] = p;
+        root_dist[v] = root_dist[p] + p_dist;
+    }
+
+    void leave(Index u)
+    {
+        left[u] = 1;
+        for (size_t i = query_first[u]; i != query_first[u + 1]; i++)
+        {
+            const pair<Index, Index> &q = (*queries)[query_ids[i]];
+            Index w = (q.first == u) ? q.second : q.first;
+            if (left[w])
+            {
+                Index lca = ancestor[find(w)];
+                (*results)[query_ids[i]] = root_dist[u] + root_dist[w] - 2 * root_dist[lca];
+            }
+        }
+        unite(u, parent[u], parent[u]);
+    }
+
+public:
+    OfflineTree(Index n)
+        :TreeGraph<Index, Weight>(n), set_size(n, 1), parent(n, 0),
+         root_dist(n, 0), left(n, 0)
+    {
+        set_parent.resize(n);
+        ancestor.resize(n);
+        for (Index v = 0; v < n; v++)
+            set_parent[v] = ancestor[v] = v;
+    }
+
+    /// Find distances between pairs of vertices and store them in
+    /// out in the same order.
+    void find_distances(const vector< pair<Index, Index> > &q, vector<distance_int> &out)
+    {
+        Index n = this->size;
+        queries = &q;
+        results = &out;
+        out.assign(q.size(), 0);
+
+        /// Bucket queries by both ends
+        query_first.assign(n + 1, 0);
+        for (size_t i = 0; i < q.size(); i++)
+        {
+            query_first[q[i].first + 1]++;
+            query_first[q[i].second + 1]++;
+        }
+        for (Index v = 0; v < n; v++)
+            query_first[v + 1] += query_first[v];
+        query_ids.resize(2 * q.size());
+        vector<size_t> next(query_first.begin(), query_first.end() - 1);
+        for (size_t i = 0; i < q.size(); i++)
+        {
+            query_ids[next[q[i].first]++] = i;
+            query_ids[next[q[i].second]++] = i;
+        }
+
+        this->dfs(0, *this);
+    }
+};
+
+/// Size of blocks in which input is read and output is written.
+const size_t io_block = 1 << 20;
+
+/// Parses unsigned decimal integers from file descriptor, skipping
+/// anything else between them. Regular files are mapped whole, other
+/// input is read in large blocks.
+class IntReader
+{
+private:
+    int fd;
+    vector<char> buffer;
+    const char *pos, *end;
+
+    void *mapping;
+    size_t mapping_size;
+
+    /// Get next block of input.
+    ///
+    /// @return false at end of input.
+    bool refill(void)
+    {
+        if (mapping != NULL)
+            return false;
+        while (1)
+        {
+            ssize_t length = ::read(fd, &buffer[0], buffer.size());
+            if ((length < 0) && (errno == EINTR))
+                continue;
+            if (length <= 0)
+                return false;
+            pos = &buffer[0];
+            end = pos + length;
+            return true;
+        }
+    }
+
+public:
+    IntReader(int f = 0)
+        :fd(f), pos(NULL), end(NULL), mapping(NULL), mapping_size(0)
+    {
+        struct stat st;
+        if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0))
+        {
+            mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED)
+            {
+                mapping_size = st.st_size;
+                madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+                pos = (const char*)mapping;
+                end = pos + mapping_size;
+                return;
+            }
+            mapping = NULL;
+        }
+        buffer.resize(io_block);
+    }
+
+    ~IntReader(void)
+    {
+        if (mapping != NULL)
+            munmap(mapping, mapping_size);
+    }
+
+    /// Read next integer.
+    ///
+    /// @return false at end of input.
+    template <class T>
+    bool read(T &value)
+    {
+        while (1)
+        {
+            while ((pos != end) && ((*pos < '0') || (*pos > '9')))
+                pos++;
+            if (pos != end)
+                break;
+            if (!refill())
+                return false;
+        }
+
+        /// Number may continue in next block
+        unsigned long long x = 0;
+        while (1)
+        {
+            while ((pos != end) && (*pos >= '0') && (*pos <= '9'))
+                x = x * 10 + (*pos++ - '0');
+            if ((pos != end) || !refill())
+                break;
+        }
+        value = x;
+        return true;
+    }
+};
+
+/// Formats unsigned integers to file descriptor, one per line. Output
+/// is written in large blocks and when writer is flushed or destroyed.
+class IntWriter
+{
+private:
+    int fd;
+    vector<char> buffer;
+    size_t used;
+
+public:
+    IntWriter(int f = 1)
+        :fd(f), buffer(io_block), used(0)
+    {}
+
+    ~IntWriter(void)
+    {
+        flush();
+    }
+
+    /// Longest line written by format
+    static const size_t max_line = 21;
+
+    /// Format x followed by separator (line break by default) to
+    /// out.
+    ///
+    /// @return Number of characters written.
+    static size_t format(unsigned long long x, char *out, char end = '\n')
+    {
+        static const char pairs[] =
+            "0001020304050607080910111213141516171819"
+            "2021222324252627282930313233343536373839"
+            "4041424344454647484950515253545556575859"
+            "6061626364656667686970717273747576777879"
+            "8081828384858687888990919293949596979899";
+
+        char digits[20];
+        char *p = digits + 20;
+        while (x >= 100)
+        {
+            p -= 2;
+            memcpy(p, pairs + (x % 100) * 2, 2);
+            x /= 100;
+        }
+        if (x >= 10)
+        {
+            p -= 2;
+            memcpy(p, pairs + x * 2, 2);
+        }
+        else
+            *--p = '0' + x;
+
+        size_t length = digits + 20 - p;
+        memcpy(out, p, length);
+        out[length] = end;
+        return length + 1;
+    }
+
+    void write(unsigned long long x, char end = '\n')
+    {
+        if (used + max_line > buffer.size())
+            flush();
+        used += format(x, &buffer[used], end);
+    }
+
+    /// Write already formatted output. Output longer than buffer is
+    /// written directly.
+    void write(const char *data, size_t length)
+    {
+        if (used + length > buffer.size())
+            flush();
+        if (length > buffer.size())
+            write_all(fd, data, length);
+        else
+        {
+            memcpy(&buffer[used], data, length);
+            used += length;
+        }
+    }
+
+    void flush(void)
+    {
+        /// Nowhere to report errors, drop output.
+        write_all(fd, &buffer[0], used);
+        used = 0;
+    }
+};
+
+/// Number of queries read and answered at once.
+const size_t query_batch = 1 << 20;
+
+/// Number of queries answered by one thread at a time.
+const size_t query_chunk = 1 << 12;
+
+/// Answers distance queries on several threads. Preprocessed engine
+/// is only read, so threads share it without locking.
+///
+/// Queries are read in batches, and every batch is split into chunks
+/// which threads take in turn. Answers of every chunk are formatted
+/// to its own buffer by the thread which took it, and buffers are
+/// written out in query order.
+template <class Engine>
+class QueryExecutor
+{
+private:
+    typedef typename Engine::index_t Index;
+
+    const Engine &tree;
+    unsigned int threads;
+
+    vector< pair<Index, Index> > queries;
+
+    /// Formatted answers of every chunk of current batch
+    vector< vector<char> > chunks;
+    vector<size_t> lengths;
+    atomic<size_t> next;
+
+    void work(void)
+    {
+        size_t count = (queries.size() + query_chunk - 1) / query_chunk;
+        for (size_t c; (c = next++) < count;)
+        {
+            size_t first = c * query_chunk;
+            size_t last = min(first + query_chunk, queries.size());
+            char *out = &chunks[c][0];
+            size_t length = 0;
+            for (size_t i = first; i < last; i++)
+                length += IntWriter::format(tree.find_distance(queries[i].first,
+                                                               queries[i].second),
+                                            out + length);
+            lengths[c] = length;
+        }
+    }
+
+public:
+    /// @param t Number of threads (at least 1)
+    QueryExecutor(const Engine &e, unsigned int t)
+        :tree(e), threads(max(t, 1u))
+    {}
+
+    /// Read given number of queries (pairs of 1-based vertices) and
+    /// write their distances in the same order.
+    void run(IntReader &in, size_t pairs, IntWriter &out)
+    {
+        queries.reserve(min(pairs, query_batch));
+        while (pairs > 0)
+        {
+            size_t batch = min(pairs, query_batch);
+            pairs -= batch;
+            queries.resize(batch);
+            for (size_t i = 0; i < batch; i++)
+            {
+                Index a = 0, b = 0;
+                in.read(a);
+                in.read(b);
+                queries[i] = make_pair(a - 1, b - 1);
+            }
 
-typedef vector <bool> brow;
-typedef vector <small_int> row;
+            size_t count = (batch + query_chunk - 1) / query_chunk;
+            if (chunks.size() < count)
+                chunks.resize(count, vector<char>(query_chunk * IntWriter::max_line));
+            lengths.resize(count);
 
-/// We use long integers here to fit maximum value of 40000×39999.
-typedef unsigned long int distance_int;
+            next = 0;
+            unsigned int workers = min<size_t>(threads, count);
+            vector<thread> pool;
+            for (unsigned int i = 1; i < workers; i++)
+                pool.push_back(thread(&QueryExecutor::work, this));
+            work();
+            for (vector<thread>::iterator i = pool.begin(); i != pool.end(); i++)
+                i->join();
+
+            for (size_t c = 0; c < count; c++)
+                out.write(&chunks[c][0], lengths[c]);
+        }
+    }
+};
 
-template <class M> void matrix_resize(M* m, small_int rows, small_int cols)
+/// Read edge length.
+///
+/// @return false (after reporting it) if length doesn't fit Weight.
+template <class Weight>
+bool read_length(IntReader &in, Weight &length)
 {
-    m->resize(rows);
-    for (typename M::iterator i = m->begin(); i != m->end(); i++)
-        i->resize(cols, 0);
+    unsigned long long x = 0;
+    in.read(x);
+    length = x;
+    if (length != x)
+    {
+        cerr << "Edge length " << x << " is too long, use --wide-lengths" << endl;
+        return false;
+    }
+    return true;
 }
 
-/// Tree class
+/// Read edges of tree (see main) and add them to engine.
 ///
-/// Implements LCA algorithm to calculate distance between two nodes
-/// using Tree::find_distance() method.
-class Tree
+/// @return false if some length doesn't fit weights of engine.
+template <class Engine>
+bool read_edges(IntReader &in, Engine &tree, typename Engine::index_t size)
 {
-    typedef vector < vector <small_int> > anc_t;
-    typedef vector < vector <distance_int> > anc_dist_t;
+    typedef typename Engine::index_t Index;
+    Index a = 0, b = 0;
+    typename Engine::weight_t length = 0;
 
-private:
-    /// Vertex count
-    small_int size;
+    for (Index i = 0; i + 1 < size; i++)
+    {
+        in.read(a);
+        in.read(b);
+        if (!read_length(in, length))
+            return false;
+        tree.add_edge(a - 1, b - 1, length);
+    }
+    return true;
+}
 
-    /// Binary logarithm of size (rounded up)
-    small_int levels;
+/// Read queries (see main) and print distances using preprocessed
+/// LCA engine.
+template <class Engine>
+void answer(IntReader &in, const Engine &tree, unsigned int threads)
+{
+    size_t pairs = 0;
+    in.read(pairs);
+
+    IntWriter out;
+    QueryExecutor<Engine> executor(tree, threads);
+    executor.run(in, pairs, out);
+}
+
+/// Read edges of tree with given node count and queries from input
+/// and print distances using LCA engine Engine.
+template <class Engine>
+int solve(IntReader &in, typename Engine::index_t size, unsigned int threads)
+{
+    Engine tree(size);
+    if (!read_edges(in, tree, size))
+        return 1;
+    tree.lca_preprocess();
+    answer(in, tree, threads);
+    return 0;
+}
+
+/// Read edges and queries like solve does, but answer all queries
+/// at once with OfflineTree.
+template <class Index, class Weight>
+int solve_offline(IntReader &in, Index size)
+{
+    Index a = 0, b = 0;
+    OfflineTree<Index, Weight> tree(size);
+    if (!read_edges(in, tree, size))
+        return 1;
+
+    size_t pairs = 0;
+    in.read(pairs);
 
-    /// Adjacency matrix. Our trees have sparse matrices, thus we use
-    /// vectors of lists.
-    vector< list <small_int> > adj;
+    vector< pair<Index, Index> > queries(pairs);
+    for (size_t i = 0; i < pairs; i++)
+    {
+        in.read(a);
+        in.read(b);
+        queries[i] = make_pair(a - 1, b - 1);
+    }
 
-    /// Distance matrix.
-    vector< list <small_int> > dist;
-    
-    /// Node visit times after full DFS.
-    vector<small_int> in_times, out_times;
+    vector<distance_int> distances;
+    tree.find_distances(queries, distances);
 
-    /// DFS timers
-    small_int in_timer, out_timer;
+    IntWriter out;
+    for (size_t i = 0; i < pairs; i++)
+        out.write(distances[i]);
+    return 0;
+}
 
-    /// DFS visit markers
-    vector<bool> visited;
+/// Read edges like solve does, then M operations for DynamicTree,
+/// each starting with its code: 0 A B prints distance between A and
+/// B, 1 A B L sets length of edge between A and B to L.
+template <class Index, class Weight>
+int solve_dynamic(IntReader &in, Index size)
+{
+    Index a = 0, b = 0;
+    Weight length = 0;
+    DynamicTree<Index, Weight> tree(size);
+    if (!read_edges(in, tree, size))
+        return 1;
 
-    /// 2^j-th ancestors of each node.
-    anc_t anc;
+    tree.lca_preprocess();
 
-    /// Distances to 2^j-th ancestors of each node.
-    anc_dist_t anc_dist;
+    size_t ops = 0;
+    in.read(ops);
 
-    /// Traverse into v with p as parent
-    void dfs_traverse(small_int v, small_int p = 0, small_int p_dist = 0)
+    IntWriter out;
+    for (size_t i = 0; i < ops; i++)
     {
-        visited[v] = 1;
-        in_times[v] = in_timer++;
-        
-        anc[v][0] = p;
-        anc_dist[v][0] = p_dist;
+        unsigned int code = 0;
+        in.read(code);
+        in.read(a);
+        in.read(b);
+        if (code == 0)
+            out.write(tree.find_distance(a - 1, b - 1));
+        else
+        {
+            if (!read_length(in, length))
+                return 1;
+            if (!tree.update_edge(a - 1, b - 1, length))
+                cerr << "No edge " << a << " " << b << endl;
+        }
+    }
+    return 0;
+}
+
+/// Read edges like solve does, then M operations for LinkCutTree,
+/// each starting with its code:
+///
+/// 0 A B      print distance between A and B (-1 if not connected),
+/// 1 A B L    set length of edge between A and B to L,
+/// 2 A B L    add edge of length L between A and B, making A a child
+///            of B,
+/// 3 A B      remove edge between A and B,
+/// 4 A B      print 1 if A and B are connected, 0 otherwise,
+/// 5 A B      print LCA of A and B (0 if not connected).
+///
+/// Node is type of node indices in LinkCutTree.
+template <class Index, class Weight, class Node>
+int solve_linkcut(IntReader &in, Index size)
+{
+    Index a = 0, b = 0;
+    Weight length = 0;
+    LinkCutTree<Index, Weight, Node> tree(size);
+    if (!read_edges(in, tree, size))
+        return 1;
+
+    tree.lca_preprocess();
+
+    size_t ops = 0;
+    in.read(ops);
 
-        for (small_int j = 1; j < levels; j++)
+    IntWriter out;
+    for (size_t i = 0; i < ops; i++)
+    {
+        unsigned int code = 0;
+        in.read(code);
+        in.read(a);
+        in.read(b);
+        Index v1 = a - 1, v2 = b - 1;
+        switch (code)
         {
-            anc[v][j] = anc[anc[v][j - 1]][j - 1];
-            anc_dist[v][j] = anc_dist[v][j - 1] + anc_dist[anc[v][j - 1]][j - 1];
+        case 0:
+            if (tree.connected(v1, v2))
+                out.write(tree.find_distance(v1, v2));
+            else
+                out.write("-1\n", 3);
+            break;
+        case 1:
+            if (!read_length(in, length))
+                return 1;
+            if (!tree.update_edge(v1, v2, length))
+                cerr << "No edge " << a << " " << b << endl;
+            break;
+        case 2:
+            if (!read_length(in, length))
+                return 1;
+            if (!tree.link(v1, v2, length))
+                cerr << "Already connected " << a << " " << b << endl;
+            break;
+        case 3:
+            if (!tree.cut(v1, v2))
+                cerr << "No edge " << a << " " << b << endl;
+            break;
+        case 4:
+            out.write(tree.connected(v1, v2));
+            break;
+        case 5:
+            out.write(tree.find_lca(v1, v2));
+            break;
+        default:
+            cerr << "Unknown operation " << code << endl;
+            return 1;
         }
+    }
+    return 0;
+}
+
+/// Shapes of synthetic trees (see TreeWorkload)
+const char *const tree_shapes[] = {"path", "star", "caterpillar", "random", "kary"};
+const int tree_shape_count = 5;
+
+/// Query mixes (see TreeWorkload)
+const char *const query_mixes[] = {"uniform", "local", "ancestor"};
+const int query_mix_count = 3;
+
+/// Number of vertices created one after another which hold both ends
+/// of local queries, and number of queries before the region moves.
+const size_t local_window = 1024;
+const size_t local_burst = 64;
+
+/// Synthetic tree of given shape and queries for benchmarks and
+/// input generation.
+///
+/// Vertices are created in order 0, 1, ..., each attached to an
+/// earlier parent:
+///
+/// path         to the previous vertex,
+/// star         to vertex 0,
+/// caterpillar  first half of vertices is a path, every other vertex
+///              is a leg hanging from a path vertex,
+/// random       to a uniformly random earlier vertex (random recursive
+///              tree, depth about ln n),
+/// kary         complete tree of given arity, filled level by level.
+///
+/// Vertices are then relabelled with a random permutation, so that
+/// labels don't follow creation order. Edges have random orientation
+/// and random lengths from 1 to 1000.
+///
+/// Query mixes:
+///
+/// uniform      both ends uniformly random,
+/// local        both ends among local_window vertices created one
+///              after another (close in tree for all shapes but
+///              random); the region moves every local_burst queries,
+/// ancestor     second end is an ancestor of the first one at
+///              uniformly random depth.
+class TreeWorkload
+{
+private:
+    typedef medium_int Vertex;
+
+    string shape;
+    size_t vertices;
+    unsigned int arity;
+    unsigned long long seed, state;
 
-        /// Traverse adjacency and distance lists. This works provided
-        /// that adjacency relations and edge lengths are added with
-        /// add_edge which maintains proper order.
-        for (list<small_int>::iterator 
-                 i = adj[v].begin(), 
-                 d = dist[v].begin(); 
-             i != adj[v].end(); i++, d++)
-            if (!visited[*i])
-                dfs_traverse(*i, v, *d);
+    /// Parent, depth and jump pointer of every vertex in creation
+    /// order (root is its own parent)
+    vector<Vertex> parent, depth, jump;
 
-        out_times[v] = out_timer++;
+    /// Label of every vertex
+    vector<Vertex> label;
+
+    static unsigned long long splitmix(unsigned long long &x)
+    {
+        unsigned long long z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
     }
 
-    small_int lca_proc(small_int v1, small_int v2)
+    /// Uniform random number in [0, n).
+    size_t random(size_t n)
     {
-        for (int j = levels - 1; j >= 0; j--)
-            if (!is_ancestor(anc[v1][j], v2))
-                v1 = anc[v1][j];
-        return anc[v1][0];
+        return splitmix(state) % n;
     }
 
-    distance_int dist_to_ancestor(small_int v, small_int a)
+    Vertex make_parent(size_t v)
     {
-        distance_int r = 0;
-        if (v == a)
+        if (shape == "path")
+            return v - 1;
+        if (shape == "star")
             return 0;
-        
-        for (int j = levels - 1; j >= 0; j--)
-            if (is_ancestor(a, anc[v][j]))
-            {
-                r += anc_dist[v][j];
-                v = anc[v][j];
-            }
-        return r + anc_dist[v][0];
+        if (shape == "caterpillar")
+        {
+            size_t spine = (vertices + 1) / 2;
+            return (v < spine) ? v - 1 : v - spine;
+        }
+        if (shape == "kary")
+            return (v - 1) / arity;
+        return random(v);
+    }
+
+    /// Find ancestor of v at depth d in O(log n). Jump pointer of
+    /// every vertex leads to an ancestor so that jumps and parent
+    /// steps combine like in a skew-binary number system.
+    Vertex ancestor(Vertex v, Vertex d) const
+    {
+        while (depth[v] > d)
+            v = (depth[jump[v]] >= d) ? jump[v] : parent[v];
+        return v;
     }
 
 public:
-    Tree(small_int n)
+    /// @param k Arity of kary trees
+    TreeWorkload(const string &s, size_t n, unsigned int k, unsigned long long x)
+        :shape(s), vertices(n), arity(max(k, 1u)), seed(x), state(x),
+         parent(n, 0), depth(n, 0), jump(n, 0), label(n)
     {
-        size = n;
-        levels = (n != 1) ? ceil(log(n) / log(2)) : 1;
+        for (size_t v = 1; v < n; v++)
+        {
+            Vertex p = make_parent(v), j = jump[p];
+            parent[v] = p;
+            depth[v] = depth[p] + 1;
+            jump[v] = (depth[p] - depth[j] == depth[j] - depth[jump[j]]) ? jump[j] : p;
+        }
 
-        dist.resize(n);
-        adj.resize(n);
+        for (size_t v = 0; v < n; v++)
+            label[v] = v;
+        for (size_t v = n; v > 1; v--)
+            swap(label[v - 1], label[random(v)]);
+    }
 
-        matrix_resize<anc_t>(&anc, n, levels);
-        matrix_resize<anc_dist_t>(&anc_dist, n, levels);
-        
-        in_times.resize(n, 0);
-        out_times.resize(n, 0);
-        visited.resize(n, 0);
+    const string& name(void) const
+    {
+        return shape;
     }
 
-    /// Add edge from v1 to v2 with given length
-    void add_edge(small_int v1, small_int v2, small_int length)
+    size_t size(void) const
     {
-        dist[v1].push_back(length);
-        dist[v2].push_back(length);
-        adj[v1].push_back(v2);
-        adj[v2].push_back(v1);
+        return vertices;
     }
 
-    void lca_preprocess(void)
+    /// Add edges of tree to engine (with 0-based vertices).
+    template <class Engine>
+    void add_edges(Engine &tree) const
     {
-        in_timer = out_timer = 0;
-        dfs_traverse(0);
+        for (size_t v = 1; v < vertices; v++)
+        {
+            unsigned long long x = seed + v, h = splitmix(x);
+            Vertex a = label[v], b = label[parent[v]];
+            if (h & (1ULL << 32))
+                swap(a, b);
+            tree.add_edge(a, b, 1 + h % 1000);
+        }
     }
 
-    /// Return true if v1 is ancestor of v2 (1-based indexing)
-    bool is_ancestor(small_int v1, small_int v2)
+    /// Make given number of queries of mix (with 0-based vertices).
+    template <class Index>
+    void make_queries(const string &mix, size_t count, vector< pair<Index, Index> > &q)
     {
-        return (in_times[v1] < in_times[v2]) && 
-            (out_times[v1] > out_times[v2]);
+        size_t window = min(local_window, vertices);
+        size_t start = 0;
+        q.resize(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            Vertex v, w;
+            if (mix == "local")
+            {
+                if (i % local_burst == 0)
+                    start = random(vertices - window + 1);
+                v = start + random(window);
+                w = start + random(window);
+            }
+            else if (mix == "ancestor")
+            {
+                v = random(vertices);
+                w = ancestor(v, random(depth[v] + 1));
+            }
+            else
+            {
+                v = random(vertices);
+                w = random(vertices);
+            }
+            q[i] = make_pair(label[v], label[w]);
+        }
     }
 
-    /// Find LCA of two vertices
-    small_int find_lca(small_int v1, small_int v2)
+    /// Print tree and queries of mix in input format (see main).
+    void generate(const string &mix, size_t queries, IntWriter &out)
+    {
+        struct Printer
+        {
+            IntWriter &out;
+
+            void add_edge(Vertex a, Vertex b, Vertex length)
+            {
+                out.write(a + 1, ' ');
+                out.write(b + 1, ' ');
+                out.write(length);
+            }
+        } printer = {out};
+
+        out.write(vertices);
+        add_edges(printer);
+
+        vector< pair<Vertex, Vertex> > q;
+        make_queries(mix, queries, q);
+        out.write(queries);
+        for (size_t i = 0; i < queries; i++)
+        {
+            out.write(q[i].first + 1, ' ');
+            out.write(q[i].second + 1);
+        }
+    }
+};
+
+typedef chrono::steady_clock bench_clock;
+
+double elapsed_ns(const bench_clock::time_point &since)
+{
+    return chrono::duration<double, nano>(bench_clock::now() - since).count();
+}
+
+/// Resident set size of process in kilobytes. Freed heap memory is
+/// returned to the system first, so that differences show memory
+/// held by live structures.
+long resident_kb(void)
+{
+    malloc_trim(0);
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f != NULL)
     {
-        small_int v;
-        if (is_ancestor(v1, v2))
-            v = v1;
-        else if (is_ancestor(v2, v1))
-            v = v2;
-        else 
-            v = lca_proc(v1, v2);
-        return v + 1;
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
     }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
 
-    /// Find distance between two vertices
-    distance_int find_distance(small_int v1, small_int v2)
+/// Print one benchmark result as JSON object.
+void print_result(ostream &out, const TreeWorkload &load, const char *engine,
+                  double preprocess_ns, long memory_kb, const double *query_ns,
+                  distance_int checksum)
+{
+    out << "{\"shape\": \"" << load.name() << "\", \"size\": " << load.size()
+        << ", \"engine\": \"" << engine << "\""
+        << ", \"preprocess_ms\": " << preprocess_ns / 1e6
+        << ", \"memory_kb\": " << memory_kb
+        << ", \"query_ns\": {";
+    for (int m = 0; m < query_mix_count; m++)
+        out << (m ? ", " : "") << "\"" << query_mixes[m] << "\": " << query_ns[m];
+    out << "}, \"checksum\": " << checksum << "}" << endl;
+}
+
+/// Benchmark engine answering queries one by one. Preprocessing
+/// includes adding edges. Memory is resident memory held by
+/// preprocessed engine. Checksum is the sum of all distances, equal
+/// for all engines.
+template <class Engine>
+void bench_engine(const char *name, const TreeWorkload &load,
+                  const vector< pair<typename Engine::index_t, typename Engine::index_t> > *q,
+                  ostream &out)
+{
+    long base = resident_kb();
+    bench_clock::time_point start = bench_clock::now();
+    Engine tree(load.size());
+    load.add_edges(tree);
+    tree.lca_preprocess();
+    double preprocess_ns = elapsed_ns(start);
+    long memory = resident_kb() - base;
+
+    double query_ns[query_mix_count];
+    distance_int checksum = 0;
+    for (int m = 0; m < query_mix_count; m++)
+    {
+        start = bench_clock::now();
+        for (size_t i = 0; i < q[m].size(); i++)
+            checksum += tree.find_distance(q[m][i].first, q[m][i].second);
+        query_ns[m] = elapsed_ns(start) / max<size_t>(q[m].size(), 1);
+    }
+    print_result(out, load, name, preprocess_ns, memory, query_ns, checksum);
+}
+
+/// Benchmark OfflineTree, which has to traverse the tree for every
+/// set of queries. Preprocessing only adds edges, so query times
+/// include the traversal; memory is taken after the first set.
+template <class Index>
+void bench_offline(const TreeWorkload &load, const vector< pair<Index, Index> > *q,
+                   ostream &out)
+{
+    long base = resident_kb(), memory = 0;
+    double preprocess_ns = 0, query_ns[query_mix_count];
+    distance_int checksum = 0;
+    for (int m = 0; m < query_mix_count; m++)
     {
-        small_int lca = find_lca(v1, v2) - 1;
-        /// @internal We can save one call if we calculate one of
-        /// distance while finding LCA.
-        return (v1 == v2) ? 0 : 
-            dist_to_ancestor(v1, lca) +
-            dist_to_ancestor(v2, lca);
+        bench_clock::time_point start = bench_clock::now();
+        OfflineTree<Index, medium_int> tree(load.size());
+        load.add_edges(tree);
+        if (m == 0)
+            preprocess_ns = elapsed_ns(start);
+
+        vector<distance_int> distances;
+        start = bench_clock::now();
+        tree.find_distances(q[m], distances);
+        query_ns[m] = elapsed_ns(start) / max<size_t>(q[m].size(), 1);
+        for (size_t i = 0; i < distances.size(); i++)
+            checksum += distances[i];
+        if (m == 0)
+            memory = resident_kb() - base;
     }
- 
+    print_result(out, load, "offline", preprocess_ns, memory, query_ns, checksum);
+}
+
+/// Run queries of every mix on tree of workload with every engine
+/// and print results, one JSON object per engine.
+template <class Index>
+void run_benchmark(TreeWorkload &load, size_t queries, ostream &out)
+{
+    vector< pair<Index, Index> > q[query_mix_count];
+    for (int m = 0; m < query_mix_count; m++)
+        load.make_queries(query_mixes[m], queries, q[m]);
+
+    bench_engine< Tree<Index, medium_int> >("lifting", load, q, out);
+    bench_engine< EulerTree<Index, medium_int> >("euler", load, q, out);
+    bench_engine< DynamicTree<Index, medium_int> >("dynamic", load, q, out);
+    if ((large_int)load.size() * 2 <= (medium_int)~0)
+        bench_engine< LinkCutTree<Index, medium_int, medium_int> >("linkcut", load, q, out);
+    else
+        bench_engine< LinkCutTree<Index, medium_int, large_int> >("linkcut", load, q, out);
+    bench_offline(load, q, out);
+}
+
+/// Command line options (see main)
+struct Options
+{
+    string engine;
+    const char *index_path, *compile_path;
+    unsigned int threads;
+
+    /// Store edge lengths in 64 bits instead of 32
+    bool wide_lengths;
+
+    Options(void)
+        :engine("lifting"), index_path(NULL), compile_path(NULL),
+         threads(thread::hardware_concurrency()), wide_lengths(false)
+    {}
 };
 
+/// Build EulerTree, write its index to file and answer queries.
+template <class Index, class Weight>
+int solve_compile(IntReader &in, Index size, const Options &opt)
+{
+    EulerTree<Index, Weight> tree(size);
+    if (!read_edges(in, tree, size))
+        return 1;
+    tree.lca_preprocess();
+    if (!tree.save(opt.compile_path))
+    {
+        cerr << "Can't write index " << opt.compile_path << endl;
+        return 1;
+    }
+    answer(in, tree, opt.threads);
+    return 0;
+}
+
+/// Answer queries with EulerTree mapped from index file, if it was
+/// written for node indices of type Index. Index holds only root
+/// distances, so width of edge lengths doesn't matter.
+template <class Index>
+bool solve_index(IntReader &in, const Options &opt)
+{
+    EulerTree<Index, medium_int> tree(0);
+    if (!tree.load(opt.index_path))
+        return false;
+    answer(in, tree, opt.threads);
+    return true;
+}
+
+/// Solve with given engine for node indices of type Index and edge
+/// lengths of type Weight.
+template <class Index, class Weight>
+int solve(IntReader &in, Index size, const Options &opt)
+{
+    const string &engine = opt.engine;
+    if (opt.compile_path != NULL)
+        return solve_compile<Index, Weight>(in, size, opt);
+    else if (engine == "offline")
+        return solve_offline<Index, Weight>(in, size);
+    else if (engine == "dynamic")
+        return solve_dynamic<Index, Weight>(in, size);
+    else if ((engine == "linkcut") && ((large_int)size * 2 <= (medium_int)~0))
+        return solve_linkcut<Index, Weight, medium_int>(in, size);
+    else if (engine == "linkcut")
+        return solve_linkcut<Index, Weight, large_int>(in, size);
+    else if (engine == "euler")
+        return solve< EulerTree<Index, Weight> >(in, size, opt.threads);
+    else
+        return solve< Tree<Index, Weight> >(in, size, opt.threads);
+}
+
+/// Solve for node indices of type Index, picking type of edge
+/// lengths.
+template <class Index>
+int solve(IntReader &in, Index size, const Options &opt)
+{
+    if (opt.wide_lengths)
+        return solve<Index, large_int>(in, size, opt);
+    else
+        return solve<Index, medium_int>(in, size, opt);
+}
+
 /// Read one integer N for node count. Then read N-1 integer 3-tuples
 /// for edges: START END DISTANCE. Then read integer M and eventually
 /// read M integer 2-tuples for pairs of nodes for which distance is
@@ -220,28 +2020,163 @@ public:
 /// 10
 /// 13
 /// 9
+///
+/// Options:
+///
+/// --engine NAME    LCA engine: lifting (binary lifting, see Tree,
+///                  default), euler (constant time queries, see
+///                  EulerTree) or offline (all queries are read first
+///                  and answered at once, see OfflineTree) or dynamic
+///                  (edge lengths change between queries, see
+///                  solve_dynamic and DynamicTree) or linkcut (edges
+///                  are also added and removed, see solve_linkcut and
+///                  LinkCutTree).
+/// --threads N      Number of threads answering queries (all cores by
+///                  default, see QueryExecutor). Offline, dynamic and
+///                  linkcut engines use one thread.
+/// --compile INDEX  Preprocess tree with euler engine, write its tables
+///                  to file INDEX and answer queries.
+/// --index INDEX    Map tables from file INDEX written with --compile
+///                  instead of reading tree: input holds only M and
+///                  queries. Processes mapping the same index share it
+///                  in page cache.
+/// --wide-lengths   Store edge lengths in 64 bits. Lengths are 32-bit by
+///                  default, and longer ones are rejected.
+///
+/// Benchmarking options (see TreeWorkload and run_benchmark):
+///
+/// --bench N        Run benchmark with synthetic trees of 1000, 10^4,
+///                  ... vertices up to N and print results in JSON.
+/// --generate N     Print synthetic input with tree of N vertices.
+/// --shape NAME     Tree shape: path, star, caterpillar, random or
+///                  kary (benchmark uses all shapes by default,
+///                  generated trees are random).
+/// --arity K        Children of every vertex in kary trees (2 by
+///                  default).
+/// --mix NAME       Mix of generated queries: uniform (default), local
+///                  or ancestor. Benchmark uses all mixes.
+/// --queries Q      Number of queries (1000000 by default).
+/// --seed X         Random seed.
 
 int main(int argc, char* argv[])
 {
-    small_int size, a, b, length, pairs;
+    Options opt;
+    large_int size = 0;
+    size_t bench_size = 0, generate_size = 0, queries = 1000000;
+    const char *shape = NULL, *mix = "uniform";
+    unsigned int arity = 2;
+    unsigned long long seed = 1;
 
-    cin >> size;
-    Tree tree(size);
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = (i + 1 < argc);
+        if (!strcmp(argv[i], "--engine") && has_value)
+            opt.engine = argv[++i];
+        else if (!strcmp(argv[i], "--threads") && has_value)
+            opt.threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--compile") && has_value)
+            opt.compile_path = argv[++i];
+        else if (!strcmp(argv[i], "--index") && has_value)
+            opt.index_path = argv[++i];
+        else if (!strcmp(argv[i], "--wide-lengths"))
+            opt.wide_lengths = true;
+        else if (!strcmp(argv[i], "--bench") && has_value)
+            bench_size = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--generate") && has_value)
+            generate_size = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--shape") && has_value)
+            shape = argv[++i];
+        else if (!strcmp(argv[i], "--arity") && has_value)
+            arity = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--mix") && has_value)
+            mix = argv[++i];
+        else if (!strcmp(argv[i], "--queries") && has_value)
+            queries = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && has_value)
+            seed = strtoull(argv[++i], NULL, 10);
+        else
+        {
+            cerr << "Usage: " << argv[0]
+                 << " [--engine lifting|euler|offline|dynamic|linkcut] [--threads N]"
+                 << " [--compile INDEX | --index INDEX] [--wide-lengths]" << endl
+                 << "       " << argv[0]
+                 << " --bench N | --generate N [--shape NAME] [--arity K]"
+                 << " [--mix NAME] [--queries Q] [--seed X]" << endl;
+            return 1;
+        }
+    }
 
-    for (small_int i = 0; i < size - 1; i++)
+    if ((shape != NULL) && (find(tree_shapes, tree_shapes + tree_shape_count, string(shape)) ==
+                            tree_shapes + tree_shape_count))
     {
-        cin >> a >> b >> length;
-        tree.add_edge(a - 1, b - 1, length);
+        cerr << "Unknown shape " << shape << endl;
+        return 1;
+    }
+    if (find(query_mixes, query_mixes + query_mix_count, string(mix)) ==
+        query_mixes + query_mix_count)
+    {
+        cerr << "Unknown query mix " << mix << endl;
+        return 1;
+    }
+    if (max(bench_size, generate_size) > (medium_int)~0)
+    {
+        cerr << "Synthetic trees are limited to " << (medium_int)~0 << " vertices" << endl;
+        return 1;
     }
 
-    tree.lca_preprocess();
-    cin >> pairs;
-    
-    for (small_int i = 0; i < pairs; i++)
+    if (bench_size > 0)
+    {
+        for (int s = 0; s < tree_shape_count; s++)
+        {
+            if ((shape != NULL) && strcmp(shape, tree_shapes[s]))
+                continue;
+            for (size_t n = min<size_t>(1000, bench_size); ; n = min(n * 10, bench_size))
+            {
+                TreeWorkload load(tree_shapes[s], n, arity, seed);
+                if (n <= (small_int)~0)
+                    run_benchmark<small_int>(load, queries, cout);
+                else
+                    run_benchmark<medium_int>(load, queries, cout);
+                if (n == bench_size)
+                    break;
+            }
+        }
+        return 0;
+    }
+    if (generate_size > 0)
+    {
+        TreeWorkload load((shape != NULL) ? shape : "random", generate_size, arity, seed);
+        IntWriter out;
+        load.generate(mix, queries, out);
+        return 0;
+    }
+    const string &engine = opt.engine;
+    if ((engine != "lifting") && (engine != "euler") && (engine != "offline") &&
+        (engine != "dynamic") && (engine != "linkcut"))
     {
-        cin >> a >> b;
-        cout << tree.find_distance(a - 1, b - 1) << endl;
+        cerr << "Unknown engine " << engine << endl;
+        return 1;
     }
 
-    return 0;
+    IntReader in;
+    if (opt.index_path != NULL)
+    {
+        if (!solve_index<small_int>(in, opt) &&
+            !solve_index<medium_int>(in, opt) &&
+            !solve_index<large_int>(in, opt))
+        {
+            cerr << "Can't open index " << opt.index_path << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    in.read(size);
+
+    if (size <= (small_int)~0)
+        return solve<small_int>(in, (small_int)size, opt);
+    else if (size <= (medium_int)~0)
+        return solve<medium_int>(in, (medium_int)size, opt);
+    else
+        return solve<large_int>(in, (large_int)size, opt);
 }
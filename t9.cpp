@@ -22,404 +22,3339 @@
 ///    written permission.
 
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <algorithm>
-#include <list>
 #include <vector>
-#include <stack>
+#include <unordered_map>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
-/// Trie level.
-typedef unsigned char level_t;
+/// Hot path statistics (see TrieStats and ReaderStats) are only
+/// collected if T9_STATS is defined, otherwise statements wrapped in
+/// T9_STAT are compiled out.
+#ifdef T9_STATS
+#define T9_STAT(statement) statement
+const bool stats_enabled = true;
+#else
+#define T9_STAT(statement)
+const bool stats_enabled = false;
+#endif
 
 /// Word frequency.
 typedef unsigned int frequency_t;
 
-const int bufsize = 100005;
+/// Keypad layouts. Trie and everything built on it take layout as a
+/// template parameter, so every layout gets its own trie code with
+/// node fan-out and key lookup tables fixed at compile time.
+///
+/// Layout is a class with:
+///
+/// key_count     Number of keys (fan-out of trie nodes). Key with
+///               index 0 holds punctuation, letters are typed with
+///               keys from index 1.
+/// key_chars     Input character of every key (key_count of them).
+///               Space, line break and asterisk are reserved.
+/// key_table     Key index of every input character, generated from
+///               key_chars by make_key_table.
+/// name          Layout name stored in dictionary images.
+/// key(c, end)   Index of key of letter starting at c in text ending
+///               at end, or -1 if it's not a letter of layout. Moves
+///               c past the letter.
+///
+/// A custom layout only needs to provide these members.
+
+/// Key index of every input character, or -1 if it isn't a key.
+struct KeyTable
+{
+    signed char keys[256];
+
+    constexpr int operator [](char c) const
+    {
+        return keys[(unsigned char)c];
+    }
+};
+
+/// Character codes 0 to N - 1 as template parameter pack.
+template <int... C>
+struct CharCodes
+{};
+
+template <int N, int... C>
+struct MakeCharCodes : MakeCharCodes<N - 1, N - 1, C...>
+{};
+
+template <int... C>
+struct MakeCharCodes<0, C...>
+{
+    typedef CharCodes<C...> type;
+};
+
+/// Index of key among keys k to count - 1 with input character c,
+/// or -1.
+constexpr int find_key(const char *chars, int count, int c, int k = 0)
+{
+    return (k == count) ? -1 : (((unsigned char)chars[k] == c) ? k : find_key(chars, count, c, k + 1));
+}
+
+template <int... C>
+constexpr KeyTable make_key_table(const char *chars, int count, CharCodes<C...>)
+{
+    return KeyTable{{(signed char)find_key(chars, count, C)...}};
+}
+
+/// Build table of keys with given input characters at compile time.
+constexpr KeyTable make_key_table(const char *chars, int count)
+{
+    return make_key_table(chars, count, MakeCharCodes<256>::type());
+}
+
+/// Latin letters a-z on keys 2-9.
+struct LatinLayout
+{
+    static constexpr int key_count = 9;
+    static constexpr char key_chars[key_count] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    static constexpr KeyTable key_table = make_key_table(key_chars, key_count);
+    static constexpr char name[8] = {'l', 'a', 't', 'i', 'n'};
+
+    /// Key indices of letters a to z
+    static constexpr signed char keys[26] = {1, 1, 1,
+                                             2, 2, 2,
+                                             3, 3, 3,
+                                             4, 4, 4,
+                                             5, 5, 5,
+                                             6, 6, 6, 6,
+                                             7, 7, 7,
+                                             8, 8, 8, 8};
+
+    static int key(const char *&c, const char *)
+    {
+        unsigned char letter = *c++ - 'a';
+        return (letter < 26) ? keys[letter] : -1;
+    }
+};
+
+constexpr char LatinLayout::key_chars[LatinLayout::key_count];
+constexpr KeyTable LatinLayout::key_table;
+constexpr char LatinLayout::name[8];
+constexpr signed char LatinLayout::keys[26];
 
-/// Mapping of characters to digital keys
-const char char_keys[26] = {'2', '2', '2',
-                            '3', '3', '3',
-                            '4', '4', '4',
-                            '5', '5', '5',
-                            '6', '6', '6',
-                            '7', '7', '7', '7',
-                            '8', '8', '8',
-                            '9', '9', '9', '9'};
+/// Russian letters in UTF-8 on keys 2-9 (four letters per key, ё
+/// goes with е).
+struct CyrillicLayout
+{
+    static constexpr int key_count = 9;
+    static constexpr char key_chars[key_count] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    static constexpr KeyTable key_table = make_key_table(key_chars, key_count);
+    static constexpr char name[8] = {'c', 'y', 'r', 'i', 'l', 'l', 'i', 'c'};
+
+    /// Key indices of code points U+0430 (а) to U+0451 (ё)
+    static constexpr signed char keys[34] = {1, 1, 1, 1, 2, 2, 2, 2,
+                                             3, 3, 3, 3, 4, 4, 4, 4,
+                                             5, 5, 5, 5, 6, 6, 6, 6,
+                                             7, 7, 7, 7, 8, 8, 8, 8,
+                                             -1, 2};
+
+    static int key(const char *&c, const char *end)
+    {
+        /// All letters are two-byte sequences with lead byte D0 or D1
+        unsigned char lead = c[0];
+        if (((lead & 0xFE) != 0xD0) || (end - c < 2) || ((c[1] & 0xC0) != 0x80))
+        {
+            c++;
+            return -1;
+        }
+        unsigned int code = (((lead & 0x1F) << 6) | (c[1] & 0x3F)) - 0x430;
+        c += 2;
+        return (code < 34) ? keys[code] : -1;
+    }
+};
 
-/// Word with frequency
+constexpr char CyrillicLayout::key_chars[CyrillicLayout::key_count];
+constexpr KeyTable CyrillicLayout::key_table;
+constexpr char CyrillicLayout::name[8];
+constexpr signed char CyrillicLayout::keys[34];
+
+/// Index of word in Trie word table.
+typedef unsigned int word_index_t;
+
+/// Word contents as stored in text arena
 class Word
 {
 public:
-    const string str;
+    /// Word characters (not NUL-terminated)
+    const char *str;
+
+    size_t length;
 
     /// Word frequency must be increased by 1 after each use only if
     /// this is true
-    const bool bumpable;
-    
-    Word()
-        :bumpable(false)
+    bool bumpable;
+
+    Word(const char *s, size_t l, bool b)
+        :str(s), length(l), bumpable(b)
+    {}
+
+    void send(ostream &out) const
+    {
+        out.write(str, length);
+    }
+};
+
+ostream& operator <<(ostream &out, const Word &w)
+{
+    w.send(out);
+    return out;
+}
+
+/// Word ordering stamp. Among words with equal frequency, word with
+/// greater stamp comes first.
+typedef long long stamp_t;
+
+/// Position of word among other words stored under the same key.
+struct Rank
+{
+    frequency_t freq;
+    stamp_t stamp;
+
+    Rank(frequency_t f, stamp_t s)
+        :freq(f), stamp(s)
     {}
 
-    Word(const string &s, const bool &b = true)
-        :str(s), bumpable(b)
+    /// True if word with this rank is offered before word with rank
+    /// r, i.e. it's more frequent or equally frequent but newer.
+    bool operator <(const Rank &r) const
+    {
+        return (freq > r.freq) || ((freq == r.freq) && (stamp > r.stamp));
+    }
+};
+
+/// Index of node in RankForest node pool.
+typedef unsigned int rank_index_t;
+
+/// Order statistic trees: AVL trees of ranked items with subtree
+/// sizes, so n-th item can be selected and moved to another rank in
+/// logarithmic time. Height is bounded by 1.44 log2 n no matter in
+/// which order ranks arrive, and all operations are iterative.
+///
+/// All trees of forest share one node pool and are referred to by
+/// indices of their roots, 0 being an empty tree. Nodes are never
+/// freed, and moving an item to another rank relinks its node, so
+/// nothing is allocated after items have been inserted.
+template <class Data>
+class RankForest
+{
+private:
+    struct Node
+    {
+        Rank rank;
+        Data data;
+        rank_index_t left, right, parent;
+
+        /// Number of nodes in subtree rooted at this node
+        unsigned int size;
+
+        /// Height of subtree rooted at this node
+        unsigned char height;
+
+        Node(const Data &d, const Rank &r)
+            :rank(r), data(d), left(0), right(0), parent(0),
+             size(1), height(1)
+        {}
+    };
+
+    /// Node pool. Element 0 is a sentinel with zero height and size
+    /// which stands for missing children.
+    vector<Node> nodes;
+
+    /// Nodes visited by searches and pool reallocations (only
+    /// counted with T9_STATS)
+    mutable unsigned long long visits;
+    unsigned long long allocations;
+
+    void update(rank_index_t t)
+    {
+        Node &n = nodes[t];
+        n.height = 1 + max(nodes[n.left].height, nodes[n.right].height);
+        n.size = 1 + nodes[n.left].size + nodes[n.right].size;
+    }
+
+    rank_index_t leftmost(rank_index_t t) const
+    {
+        while (nodes[t].left != 0)
+            t = nodes[t].left;
+        return t;
+    }
+
+    /// Make n take place of child c of p.
+    void replace_child(rank_index_t &root, rank_index_t p, rank_index_t c, rank_index_t n)
+    {
+        if (p == 0)
+            root = n;
+        else if (nodes[p].left == c)
+            nodes[p].left = n;
+        else
+            nodes[p].right = n;
+        if (n != 0)
+            nodes[n].parent = p;
+    }
+
+    /// @return New subtree root.
+    rank_index_t rotate_left(rank_index_t &root, rank_index_t x)
+    {
+        rank_index_t y = nodes[x].right;
+        nodes[x].right = nodes[y].left;
+        if (nodes[y].left != 0)
+            nodes[nodes[y].left].parent = x;
+        replace_child(root, nodes[x].parent, x, y);
+        nodes[y].left = x;
+        nodes[x].parent = y;
+        update(x);
+        update(y);
+        return y;
+    }
+
+    /// @return New subtree root.
+    rank_index_t rotate_right(rank_index_t &root, rank_index_t x)
+    {
+        rank_index_t y = nodes[x].left;
+        nodes[x].left = nodes[y].right;
+        if (nodes[y].right != 0)
+            nodes[nodes[y].right].parent = x;
+        replace_child(root, nodes[x].parent, x, y);
+        nodes[y].right = x;
+        nodes[x].parent = y;
+        update(x);
+        update(y);
+        return y;
+    }
+
+    unsigned char height_of(rank_index_t t) const
+    {
+        return nodes[t].height;
+    }
+
+    /// Restore heights, sizes and balance on the path from t to
+    /// root.
+    void rebalance(rank_index_t &root, rank_index_t t)
+    {
+        while (t != 0)
+        {
+            update(t);
+            const Node &n = nodes[t];
+            int balance = height_of(n.left) - height_of(n.right);
+            if (balance > 1)
+            {
+                if (height_of(nodes[n.left].left) < height_of(nodes[n.left].right))
+                    rotate_left(root, n.left);
+                t = rotate_right(root, t);
+            }
+            else if (balance < -1)
+            {
+                if (height_of(nodes[n.right].right) < height_of(nodes[n.right].left))
+                    rotate_right(root, n.right);
+                t = rotate_left(root, t);
+            }
+            t = nodes[t].parent;
+        }
+    }
+
+    void link(rank_index_t &root, rank_index_t x)
+    {
+        nodes[x].left = nodes[x].right = 0;
+        nodes[x].height = 1;
+        nodes[x].size = 1;
+        if (root == 0)
+        {
+            nodes[x].parent = 0;
+            root = x;
+            return;
+        }
+
+        const Rank &r = nodes[x].rank;
+        rank_index_t p = root;
+        while (1)
+        {
+            T9_STAT(visits++);
+            rank_index_t &next = (r < nodes[p].rank) ? nodes[p].left : nodes[p].right;
+            if (next == 0)
+            {
+                next = x;
+                nodes[x].parent = p;
+                break;
+            }
+            p = next;
+        }
+        rebalance(root, p);
+    }
+
+    void unlink(rank_index_t &root, rank_index_t x)
+    {
+        /// Lowest node whose subtree has changed
+        rank_index_t changed;
+        Node &n = nodes[x];
+
+        if ((n.left == 0) || (n.right == 0))
+        {
+            changed = n.parent;
+            replace_child(root, n.parent, x, (n.left != 0) ? n.left : n.right);
+        }
+        else
+        {
+            /// Put in-order successor of x in its place.
+            rank_index_t s = leftmost(n.right);
+            if (nodes[s].parent != x)
+            {
+                changed = nodes[s].parent;
+                replace_child(root, nodes[s].parent, s, nodes[s].right);
+                nodes[s].right = n.right;
+                nodes[n.right].parent = s;
+            }
+            else
+                changed = s;
+            nodes[s].left = n.left;
+            nodes[n.left].parent = s;
+            replace_child(root, n.parent, x, s);
+        }
+        rebalance(root, changed);
+    }
+
+    rank_index_t select_node(rank_index_t t, size_t n) const
+    {
+        while (1)
+        {
+            T9_STAT(visits++);
+            size_t ls = nodes[nodes[t].left].size;
+            if (n < ls)
+                t = nodes[t].left;
+            else if (n > ls)
+            {
+                n -= ls + 1;
+                t = nodes[t].right;
+            }
+            else
+                return t;
+        }
+    }
+
+public:
+    /// STL-style input in-order iterator for tree. Successors are
+    /// found using parent links, so no traversal stack is kept.
+    class iterator {
+    private:
+        /// Standard traits.
+        typedef input_iterator_tag iterator_category;
+        typedef const Data& value_type;
+        typedef ptrdiff_t distance_type;
+
+        const RankForest *forest;
+        rank_index_t node;
+
+    public:
+        iterator(const RankForest *f, rank_index_t t)
+            :forest(f), node(t)
+        {}
+
+        iterator& operator ++(void)
+        {
+            const vector<Node> &nodes = forest->nodes;
+            if (nodes[node].right != 0)
+                node = forest->leftmost(nodes[node].right);
+            else
+            {
+                rank_index_t from;
+                do
+                {
+                    from = node;
+                    node = nodes[node].parent;
+                }
+                while ((node != 0) && (nodes[node].right == from));
+            }
+            return *this;
+        }
+
+        iterator operator ++(int)
+        {
+            iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        bool operator ==(const iterator &iter) const
+        {
+            return node == iter.node;
+        }
+
+        bool operator !=(const iterator &iter) const
+        {
+            return node != iter.node;
+        }
+
+        const Data& operator *(void) const
+        {
+            return forest->nodes[node].data;
+        }
+
+        /// @return Rank of item that iterator currently points at.
+        const Rank& rank(void) const
+        {
+            return forest->nodes[node].rank;
+        }
+    };
+
+    RankForest(void)
+        :nodes(1, Node(Data(), Rank(0, 0))), visits(0), allocations(0)
+    {
+        nodes[0].size = 0;
+        nodes[0].height = 0;
+    }
+
+    iterator begin(rank_index_t root) const
+    {
+        return iterator(this, (root != 0) ? leftmost(root) : 0);
+    }
+
+    iterator end(void) const
+    {
+        return iterator(this, 0);
+    }
+
+    void insert(rank_index_t &root, const Data &d, const Rank &r)
+    {
+        T9_STAT(allocations += (nodes.size() == nodes.capacity()));
+        nodes.push_back(Node(d, r));
+        link(root, nodes.size() - 1);
+    }
+
+    /// Get rank of n-th item.
+    const Rank& rank_at(rank_index_t root, size_t n) const
+    {
+        return nodes[select_node(root, n)].rank;
+    }
+
+    /// Count items ranked before r.
+    size_t count_before(rank_index_t t, const Rank &r) const
+    {
+        size_t count = 0;
+        while (t != 0)
+        {
+            T9_STAT(visits++);
+            const Node &x = nodes[t];
+            if (x.rank < r)
+            {
+                count += nodes[x.left].size + 1;
+                t = x.right;
+            }
+            else
+                t = x.left;
+        }
+        return count;
+    }
+
+    /// Get k-th (0-based) of values first, first + 1, ... which are
+    /// not stored in tree. Tree must rank values in ascending order.
+    Data select_missing(rank_index_t t, Data first, size_t k) const
+    {
+        /// Number of stored values less than ones in subtree t
+        size_t skipped = 0;
+        while (t != 0)
+        {
+            T9_STAT(visits++);
+            const Node &x = nodes[t];
+            size_t ls = nodes[x.left].size;
+            if (k < (size_t)(x.data - first) - (skipped + ls))
+                t = x.left;
+            else
+            {
+                skipped += ls + 1;
+                t = x.right;
+            }
+        }
+        return first + k + skipped;
+    }
+
+    /// Select n-th item of sequence merged from items of tree and some
+    /// other ranked items, where before(r) is the number of other
+    /// items ranked before r.
+    ///
+    /// @param found Set to true if n-th merged item is a tree item.
+    ///
+    /// @return Number of tree items ranked before n-th merged item.
+    template <class Counter>
+    size_t merge_select(rank_index_t t, size_t n, const Counter &before, bool &found) const
+    {
+        size_t acc = 0;
+        found = false;
+        while (t != 0)
+        {
+            T9_STAT(visits++);
+            const Node &x = nodes[t];
+            size_t ls = nodes[x.left].size;
+            size_t pos = acc + ls + before(x.rank);
+            if (n < pos)
+                t = x.left;
+            else if (n == pos)
+            {
+                found = true;
+                return acc + ls;
+            }
+            else
+            {
+                acc += ls + 1;
+                t = x.right;
+            }
+        }
+        return acc;
+    }
+
+    /// Number of tree nodes visited by searches so far.
+    unsigned long long visited(void) const
+    {
+        return visits;
+    }
+
+    /// Number of node pool reallocations so far.
+    unsigned long long reallocations(void) const
+    {
+        return allocations;
+    }
+
+    /// Move n-th item to new rank.
+    ///
+    /// @return Moved item.
+    const Data& move(rank_index_t &root, size_t n, const Rank &r)
+    {
+        rank_index_t x = select_node(root, n);
+        unlink(root, x);
+        nodes[x].rank = r;
+        link(root, x);
+        return nodes[x].data;
+    }
+};
+
+typedef RankForest<word_index_t> word_forest;
+
+/// Index of node in trie node table.
+typedef unsigned int node_index_t;
+
+/// Trie node. Children and words are referenced by 32-bit indices
+/// into tables rather than by pointers, so nodes may be stored in a
+/// relocatable dictionary image.
+template <class Layout>
+struct TrieNode
+{
+    /// Child nodes for keys of layout. Root node is never a child,
+    /// so 0 means no child.
+    node_index_t children[Layout::key_count];
+
+    /// Words stored under full key of this node occupy count entries
+    /// of word table starting with first, in initial rank order.
+    word_index_t first;
+    unsigned int count;
+
+    TrieNode(void)
+        :first(0), count(0)
+    {
+        fill(children, children + Layout::key_count, 0);
+    }
+};
+
+/// Word table entry.
+struct WordEntry
+{
+    /// Location of word characters in text section
+    unsigned int offset;
+
+    /// Initial frequency
+    frequency_t freq;
+
+    unsigned short length;
+    bool bumpable;
+
+    WordEntry(unsigned int o, frequency_t f, unsigned short l, bool b)
+        :offset(o), freq(f), length(l), bumpable(b)
     {}
+};
+
+/// Initial rank of word with given index in word table. Words are
+/// laid out in rank order, so earlier ones get greater stamps.
+Rank initial_rank(word_index_t i, const WordEntry &e)
+{
+    return Rank(e.freq, -(stamp_t)i - 1);
+}
+
+/// Number of most frequent completions cached for every trie node.
+const unsigned int completion_count = 8;
+
+/// Marks unused entries of completion lists.
+const word_index_t no_word = ~0u;
+
+/// Dictionary image header. Header is followed by node table, word
+/// table, completion table and text section.
+///
+/// Completion table holds completion_count words for every node:
+/// indices of most frequent words stored under the node or its
+/// descendants, in rank order. Lists of nodes with fewer words are
+/// padded with no_word.
+struct ImageHeader
+{
+    char magic[8];
+
+    /// Name of keypad layout
+    char layout[8];
+
+    unsigned int node_count, word_count, text_size, completion_count;
+
+    /// Size of node and word table entries (guards against images
+    /// built on an incompatible platform)
+    unsigned short node_size, word_size;
+};
+
+const char image_magic[8] = {'T', '9', 'D', 'I', 'C', 'T', '0', '3'};
+
+/// Read-only memory mapping of whole file.
+class MappedFile
+{
+private:
+    void *mapping;
+    size_t mapping_size;
+
+public:
+    MappedFile(void)
+        :mapping(NULL), mapping_size(0)
+    {}
+
+    ~MappedFile(void)
+    {
+        close();
+    }
+
+    bool open(const char *path)
+    {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        mapping_size = st.st_size;
+        mapping = mmap(NULL, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            mapping = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    void close(void)
+    {
+        if (mapping != NULL)
+            munmap(mapping, mapping_size);
+        mapping = NULL;
+        mapping_size = 0;
+    }
+
+    const char* data(void) const
+    {
+        return (const char*)mapping;
+    }
+
+    size_t size(void) const
+    {
+        return mapping_size;
+    }
+};
+
+/// Collects words and compiles them into dictionary image.
+template <class Layout>
+class DictionaryBuilder
+{
+private:
+    typedef TrieNode<Layout> Node;
+
+    struct Item
+    {
+        node_index_t node;
+        WordEntry entry;
+
+        Item(node_index_t v, const WordEntry &e)
+            :node(v), entry(e)
+        {}
+
+        /// Order items by node and then by frequency. Items with equal
+        /// frequency keep addition order with stable sort.
+        bool operator <(const Item &i) const
+        {
+            return (node < i.node) ||
+                ((node == i.node) && (entry.freq > i.entry.freq));
+        }
+    };
+
+    /// Orders word indices by initial rank of words.
+    class RankOrder
+    {
+    private:
+        const WordEntry *words;
+
+    public:
+        RankOrder(const WordEntry *w)
+            :words(w)
+        {}
+
+        bool operator ()(word_index_t a, word_index_t b) const
+        {
+            return initial_rank(a, words[a]) < initial_rank(b, words[b]);
+        }
+    };
+
+    vector<Node> nodes;
+    vector<Item> items;
+    vector<char> text;
+
+    /// Word table and completion table filled by compile
+    vector<WordEntry> words;
+    vector<word_index_t> completions;
+
+    /// Get child of node v under key, creating it if needed.
+    node_index_t get_child(node_index_t v, int key)
+    {
+        if (nodes[v].children[key] == 0)
+        {
+            /// Table may be reallocated here, so do not hold any
+            /// references to nodes across this call.
+            nodes.push_back(Node());
+            nodes[v].children[key] = nodes.size() - 1;
+        }
+        return nodes[v].children[key];
+    }
+
+    /// Copy word contents to text section and store it under node v.
+    void add_word_proc(node_index_t v, const char *contents, size_t length,
+                       const frequency_t &freq, bool bumpable)
+    {
+        items.push_back(Item(v, WordEntry(text.size(), freq, length, bumpable)));
+        text.insert(text.end(), contents, contents + length);
+    }
+
+    /// Sort candidates by rank and store best completion_count of
+    /// them (padded with no_word) in out.
+    static void keep_best(vector<word_index_t> &candidates,
+                          const WordEntry *words, word_index_t *out)
+    {
+        /// Words of different nodes may have equal frequencies,
+        /// so compare full ranks.
+        size_t keep = min<size_t>(candidates.size(), completion_count);
+        partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(),
+                     RankOrder(words));
+        copy(candidates.begin(), candidates.begin() + keep, out);
+        fill(out + keep, out + completion_count, no_word);
+    }
+
+    /// Lay out words of every node contiguously in rank order and
+    /// compute completion lists.
+    void compile(void)
+    {
+        stable_sort(items.begin(), items.end());
+
+        words.clear();
+        words.reserve(items.size());
+        for (typename vector<Item>::iterator i = items.begin(); i != items.end(); i++)
+        {
+            Node &n = nodes[i->node];
+            if (n.count++ == 0)
+                n.first = words.size();
+            words.push_back(i->entry);
+        }
+        vector<Item>().swap(items);
+
+        /// Children are always added after their parents, so when
+        /// nodes are visited backwards, completions of children are
+        /// ready by the time their parent is reached.
+        completions.assign(nodes.size() * completion_count, no_word);
+        vector<word_index_t> candidates;
+        for (node_index_t v = nodes.size(); v-- > 0;)
+        {
+            const Node &n = nodes[v];
+            candidates.clear();
+            for (word_index_t i = n.first; i != n.first + min(n.count, completion_count); i++)
+                candidates.push_back(i);
+            for (int key = 0; key < Layout::key_count; key++)
+            {
+                if (n.children[key] == 0)
+                    continue;
+                word_index_t *c = &completions[n.children[key] * completion_count];
+                for (unsigned int j = 0; (j < completion_count) && (c[j] != no_word); j++)
+                    candidates.push_back(c[j]);
+            }
+            keep_best(candidates, words.data(), &completions[v * completion_count]);
+        }
+    }
+
+    static ImageHeader make_header(size_t node_count, size_t word_count, size_t text_size)
+    {
+        ImageHeader h;
+        memset(&h, 0, sizeof(h));
+        copy(image_magic, image_magic + 8, h.magic);
+        copy(Layout::name, Layout::name + 8, h.layout);
+        h.node_count = node_count;
+        h.word_count = word_count;
+        h.text_size = text_size;
+        h.completion_count = completion_count;
+        h.node_size = sizeof(Node);
+        h.word_size = sizeof(WordEntry);
+        return h;
+    }
+
+    /// Store compiled tables in image.
+    void write_image(vector<char> &image) const
+    {
+        ImageHeader h = make_header(nodes.size(), words.size(), text.size());
+
+        image.clear();
+        image.reserve(sizeof(h) + nodes.size() * sizeof(Node) +
+                      words.size() * sizeof(WordEntry) +
+                      completions.size() * sizeof(word_index_t) + text.size());
+        image.insert(image.end(), (const char*)&h, (const char*)(&h + 1));
+        image.insert(image.end(), (const char*)&nodes[0], (const char*)(&nodes[0] + nodes.size()));
+        if (!words.empty())
+            image.insert(image.end(), (const char*)&words[0], (const char*)(&words[0] + words.size()));
+        image.insert(image.end(), (const char*)&completions[0],
+                     (const char*)(&completions[0] + completions.size()));
+        image.insert(image.end(), text.begin(), text.end());
+    }
+
+    /// Tables of image being joined from shards.
+    struct JointImage
+    {
+        Node *nodes;
+        WordEntry *words;
+        word_index_t *completions;
+        char *text;
+    };
+
+    /// Copy compiled shard (a dictionary whose words all start with
+    /// the same key) to joint image. Shard root is dropped, the rest
+    /// of its nodes is relocated by node_base, so that its subtrie
+    /// may be attached under joint root.
+    void write_shard(const JointImage &out, node_index_t node_base,
+                     word_index_t word_base, unsigned int text_base) const
+    {
+        for (node_index_t v = 1; v < nodes.size(); v++)
+        {
+            Node n = nodes[v];
+            for (int key = 0; key < Layout::key_count; key++)
+                if (n.children[key] != 0)
+                    n.children[key] += node_base;
+            n.first += word_base;
+            out.nodes[v + node_base] = n;
+
+            const word_index_t *c = &completions[v * completion_count];
+            word_index_t *o = out.completions + (size_t)(v + node_base) * completion_count;
+            for (unsigned int j = 0; j < completion_count; j++)
+                o[j] = (c[j] != no_word) ? c[j] + word_base : no_word;
+        }
+        for (size_t i = 0; i < words.size(); i++)
+        {
+            out.words[word_base + i] = words[i];
+            out.words[word_base + i].offset += text_base;
+        }
+        if (!text.empty())
+            memcpy(out.text + text_base, &text[0], text.size());
+    }
+
+public:
+    DictionaryBuilder(void)
+        :nodes(1)
+    {}
+
+    /// Add new word under full key given by its letters.
+    ///
+    /// @return false if word has characters which are not letters of
+    /// layout (word is not added then).
+    bool add_word(const char *contents, size_t length, const frequency_t &freq)
+    {
+        const char *end = contents + length;
+        for (const char *c = contents; c != end;)
+            if (Layout::key(c, end) < 1)
+                return false;
+
+        node_index_t v = 0;
+        for (const char *c = contents; c != end;)
+            v = get_child(v, Layout::key(c, end));
+        add_word_proc(v, contents, length, freq, true);
+        return true;
+    }
+
+    bool add_word(const string &contents, const frequency_t &freq)
+    {
+        return add_word(contents.data(), contents.size(), freq);
+    }
+
+    /// Add new punctuation mark under 1
+    void add_punctuation(const string &punct)
+    {
+        add_word_proc(get_child(0, 0), punct.data(), punct.size(), 500, false);
+    }
+
+    /// Compile dictionary and store resulting image in given buffer.
+    void build(vector<char> &image)
+    {
+        compile();
+        write_image(image);
+    }
+
+    /// Compile shards in parallel and join them into one image.
+    /// Words of every shard must start with the same key, different
+    /// for different shards.
+    static void build(vector<DictionaryBuilder> &shards, vector<char> &image,
+                      unsigned int threads)
+    {
+        threads = min<size_t>(max(threads, 1u), shards.size());
+
+        atomic<size_t> next(0);
+        vector<thread> pool;
+        for (unsigned int i = 0; i < threads; i++)
+            pool.push_back(thread([&]() {
+                        for (size_t s; (s = next++) < shards.size();)
+                            shards[s].compile();
+                    }));
+        for (vector<thread>::iterator i = pool.begin(); i != pool.end(); i++)
+            i->join();
+
+        /// Place shards one after another.
+        vector<node_index_t> node_base;
+        vector<word_index_t> word_base;
+        vector<unsigned int> text_base;
+        size_t node_count = 1, word_count = 0, text_size = 0;
+        for (typename vector<DictionaryBuilder>::iterator i = shards.begin(); i != shards.end(); i++)
+        {
+            node_base.push_back(node_count - 1);
+            word_base.push_back(word_count);
+            text_base.push_back(text_size);
+            node_count += i->nodes.size() - 1;
+            word_count += i->words.size();
+            text_size += i->text.size();
+        }
+
+        ImageHeader h = make_header(node_count, word_count, text_size);
+        image.assign(sizeof(h) + node_count * sizeof(Node) +
+                     word_count * sizeof(WordEntry) +
+                     node_count * completion_count * sizeof(word_index_t) + text_size, 0);
+        memcpy(&image[0], &h, sizeof(h));
+
+        JointImage out;
+        out.nodes = (Node*)(&image[0] + sizeof(h));
+        out.words = (WordEntry*)(out.nodes + node_count);
+        out.completions = (word_index_t*)(out.words + word_count);
+        out.text = (char*)(out.completions + node_count * completion_count);
+
+        next = 0;
+        pool.clear();
+        for (unsigned int i = 0; i < threads; i++)
+            pool.push_back(thread([&]() {
+                        for (size_t s; (s = next++) < shards.size();)
+                            shards[s].write_shard(out, node_base[s], word_base[s], text_base[s]);
+                    }));
+        for (vector<thread>::iterator i = pool.begin(); i != pool.end(); i++)
+            i->join();
+
+        /// Attach shard subtries under root and merge their
+        /// completions.
+        Node root;
+        vector<word_index_t> candidates;
+        for (size_t s = 0; s < shards.size(); s++)
+        {
+            const Node &r = shards[s].nodes[0];
+            for (int key = 0; key < Layout::key_count; key++)
+                if (r.children[key] != 0)
+                {
+                    node_index_t c = r.children[key] + node_base[s];
+                    root.children[key] = c;
+                    for (unsigned int j = 0; j < completion_count; j++)
+                        if (out.completions[c * completion_count + j] != no_word)
+                            candidates.push_back(out.completions[c * completion_count + j]);
+                }
+        }
+        out.nodes[0] = root;
+        keep_best(candidates, out.words, out.completions);
+    }
+};
+
+/// Word of dictionary text found by DictionaryParser.
+struct ParsedWord
+{
+    const char *str;
+    size_t length;
+    frequency_t freq;
+
+    ParsedWord(const char *s, size_t l, frequency_t f)
+        :str(s), length(l), freq(f)
+    {}
+};
+
+/// Parses dictionary text (integer N followed by N lines with word
+/// and frequency) from memory buffer in parallel and builds
+/// dictionary from shards of words with the same first key.
+///
+/// Text is split into ranges at line boundaries, every thread parses
+/// its range and sorts words by first key. Then every shard is built
+/// from words it got from all ranges, in input order.
+template <class Layout>
+class DictionaryParser
+{
+private:
+    /// Words of every range by first key
+    typedef vector< vector<ParsedWord> > range_words;
+
+    static bool is_space(char c)
+    {
+        return (c == ' ') || (c == '\n') || (c == '\r') || (c == '\t');
+    }
+
+    /// Parse words from lines in [p, end) into out.
+    ///
+    /// @return NULL, or start of first malformed line (with word
+    /// which isn't typed with Layout or without frequency).
+    static const char* parse_range(const char *p, const char *end, range_words &out)
+    {
+        out.assign(Layout::key_count, vector<ParsedWord>());
+        while (1)
+        {
+            while ((p != end) && is_space(*p))
+                p++;
+            if (p == end)
+                return NULL;
+
+            const char *word = p;
+            while ((p != end) && !is_space(*p))
+                p++;
+            size_t length = p - word;
+
+            int first = -1;
+            for (const char *c = word; c != p;)
+            {
+                int key = Layout::key(c, p);
+                if (key < 1)
+                    return word;
+                if (first < 0)
+                    first = key;
+            }
+
+            while ((p != end) && ((*p == ' ') || (*p == '\t')))
+                p++;
+            if ((p == end) || (*p < '0') || (*p > '9'))
+                return word;
+            frequency_t freq = 0;
+            for (; (p != end) && (*p >= '0') && (*p <= '9'); p++)
+                freq = freq * 10 + (*p - '0');
+
+            out[first].push_back(ParsedWord(word, length, freq));
+        }
+    }
+
+public:
+    /// Parse dictionary text and build its image. Like
+    /// read_dictionary, rejects whole dictionary if some line is
+    /// malformed.
+    ///
+    /// @return false on malformed input, with number of first
+    /// malformed line (counting from 1) in bad_line, or 0 if word
+    /// count doesn't match.
+    static bool build(const char *text, size_t size, vector<char> &image,
+                      unsigned int threads, size_t &bad_line)
+    {
+        const char *p = text, *end = text + size;
+        threads = max(threads, 1u);
+
+        /// Word count is only used to check input.
+        while ((p != end) && is_space(*p))
+            p++;
+        size_t count = 0;
+        for (; (p != end) && (*p >= '0') && (*p <= '9'); p++)
+            count = count * 10 + (*p - '0');
+
+        /// Cut ranges right after line breaks
+        vector<const char*> bounds(1, p);
+        for (unsigned int i = 1; i < threads; i++)
+        {
+            const char *b = max(bounds.back(), p + (end - p) * i / threads);
+            while ((b != end) && (b != text) && (*(b - 1) != '\n'))
+                b++;
+            bounds.push_back(b);
+        }
+        bounds.push_back(end);
+
+        vector<range_words> ranges(threads);
+        vector<const char*> bad(threads, (const char*)NULL);
+        vector<thread> pool;
+        for (unsigned int i = 0; i < threads; i++)
+            pool.push_back(thread([&, i]() {
+                        bad[i] = parse_range(bounds[i], bounds[i + 1], ranges[i]);
+                    }));
+        for (vector<thread>::iterator i = pool.begin(); i != pool.end(); i++)
+            i->join();
+
+        size_t parsed = 0;
+        bad_line = 0;
+        for (unsigned int i = 0; i < threads; i++)
+        {
+            if (bad[i] != NULL)
+            {
+                bad_line = 1 + count_if(text, bad[i], [](char c) { return c == '\n'; });
+                return false;
+            }
+            for (int key = 0; key < Layout::key_count; key++)
+                parsed += ranges[i][key].size();
+        }
+        if (parsed != count)
+            return false;
+
+        /// Shard 0 holds punctuation under key 1.
+        vector< DictionaryBuilder<Layout> > shards(Layout::key_count);
+        shards[0].add_punctuation(".");
+        shards[0].add_punctuation(",");
+        shards[0].add_punctuation("?");
+
+        atomic<int> next(1);
+        pool.clear();
+        for (unsigned int i = 0; i < min<unsigned int>(threads, Layout::key_count - 1); i++)
+            pool.push_back(thread([&]() {
+                        for (int key; (key = next++) < Layout::key_count;)
+                            for (unsigned int r = 0; r < threads; r++)
+                            {
+                                const vector<ParsedWord> &w = ranges[r][key];
+                                for (vector<ParsedWord>::const_iterator j = w.begin();
+                                     j != w.end(); j++)
+                                    shards[key].add_word(j->str, j->length, j->freq);
+                            }
+                    }));
+        for (vector<thread>::iterator i = pool.begin(); i != pool.end(); i++)
+            i->join();
+        ranges.clear();
+
+        DictionaryBuilder<Layout>::build(shards, image, threads);
+        return true;
+    }
+};
+
+/// Compiled dictionary: trie nodes, word table and word characters
+/// in one relocatable image which is either built in memory or
+/// mapped read-only from file produced by DictionaryBuilder.
+template <class Layout>
+class Dictionary
+{
+private:
+    typedef TrieNode<Layout> Node;
+
+    /// Image buffer if dictionary was built in memory
+    vector<char> buffer;
+
+    /// Mapped image file
+    MappedFile file;
+
+    const ImageHeader *header;
+    const Node *nodes;
+    const WordEntry *words;
+    const word_index_t *completions;
+    const char *text;
+
+    /// Validate image and set up pointers to its tables.
+    bool attach(const char *image, size_t size)
+    {
+        header = (const ImageHeader*)image;
+        if ((size < sizeof(ImageHeader)) ||
+            !equal(image_magic, image_magic + 8, header->magic) ||
+            !equal(Layout::name, Layout::name + 8, header->layout) ||
+            (header->node_size != sizeof(Node)) ||
+            (header->word_size != sizeof(WordEntry)) ||
+            (header->completion_count != completion_count) ||
+            (header->node_count == 0))
+            return false;
+
+        size_t expected = sizeof(ImageHeader) +
+            (size_t)header->node_count * sizeof(Node) +
+            (size_t)header->word_count * sizeof(WordEntry) +
+            (size_t)header->node_count * completion_count * sizeof(word_index_t) +
+            header->text_size;
+        if (size != expected)
+            return false;
+
+        nodes = (const Node*)(image + sizeof(ImageHeader));
+        words = (const WordEntry*)(nodes + header->node_count);
+        completions = (const word_index_t*)(words + header->word_count);
+        text = (const char*)(completions + (size_t)header->node_count * completion_count);
+        return true;
+    }
+
+    void close(void)
+    {
+        file.close();
+        buffer.clear();
+    }
+
+public:
+    Dictionary(void)
+        :header(NULL)
+    {}
+
+    /// Take over image built in memory (given buffer is emptied).
+    bool load(vector<char> &image)
+    {
+        close();
+        buffer.swap(image);
+        return attach(&buffer[0], buffer.size());
+    }
+
+    /// Map image file.
+    bool open(const char *path)
+    {
+        close();
+        return file.open(path) && attach(file.data(), file.size());
+    }
+
+    size_t node_count(void) const
+    {
+        return header->node_count;
+    }
+
+    size_t word_count(void) const
+    {
+        return header->word_count;
+    }
+
+    const Node& node(node_index_t v) const
+    {
+        return nodes[v];
+    }
+
+    const WordEntry& entry(word_index_t i) const
+    {
+        return words[i];
+    }
+
+    /// Get contents of word with given index.
+    Word get_word(word_index_t i) const
+    {
+        const WordEntry &e = words[i];
+        return Word(text + e.offset, e.length, e.bumpable);
+    }
+
+    /// Get initial rank of word with given index.
+    Rank get_rank(word_index_t i) const
+    {
+        return initial_rank(i, words[i]);
+    }
+
+    /// Get completion list of node v (completion_count entries).
+    const word_index_t* get_completions(node_index_t v) const
+    {
+        return completions + (size_t)v * completion_count;
+    }
+
+    /// Count words stored under node v which are initially ranked
+    /// before r.
+    size_t count_before(const Node &v, const Rank &r) const
+    {
+        word_index_t lo = v.first, hi = v.first + v.count;
+        while (lo < hi)
+        {
+            word_index_t mid = lo + (hi - lo) / 2;
+            if (get_rank(mid) < r)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo - v.first;
+    }
+
+    /// Get node of trie with given key prefix.
+    ///
+    /// @return false if no words have keys with such prefix.
+    bool find_node(const char *prefix, node_index_t &v) const
+    {
+        v = 0;
+        for (; *prefix != '\0'; prefix++)
+        {
+            int key = Layout::key_table[*prefix];
+            if ((key < 0) || (nodes[v].children[key] == 0))
+                return false;
+            v = nodes[v].children[key];
+        }
+        return true;
+    }
+};
+
+/// Bump written to session journal: word selected as n-th candidate
+/// of leaf node. Replaying records in order against the same
+/// dictionary repeats the bumps exactly.
+struct JournalRecord
+{
+    node_index_t node;
+    unsigned int n;
+};
+
+/// Learned rank of bumped word, as stored in snapshot.
+struct LearnedWord
+{
+    node_index_t node;
+    word_index_t word;
+    frequency_t freq;
+    stamp_t stamp;
+};
+
+/// Header of journal and snapshot files. Dictionary sizes identify
+/// the image files were written against.
+struct StateHeader
+{
+    char magic[8];
+    unsigned int node_count, word_count;
+
+    /// Journal: sequence number of its first record. Snapshot:
+    /// sequence number of first record not included in it.
+    unsigned long long sequence;
+
+    /// Snapshot only: session front stamp and number of words.
+    stamp_t front_stamp;
+    unsigned long long count;
+};
+
+const char journal_magic[8] = {'T', '9', 'J', 'R', 'N', 'L', '0', '1'};
+const char snapshot_magic[8] = {'T', '9', 'S', 'N', 'A', 'P', '0', '1'};
+
+/// Write whole buffer to file descriptor.
+bool write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+/// Replace file at path with given contents, so that either old or
+/// new contents survive a crash.
+bool replace_file(const string &path, const char *data, size_t length)
+{
+    string temp = path + ".tmp";
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = write_all(fd, data, length) && (fsync(fd) == 0);
+    ok = (::close(fd) == 0) && ok;
+    if (!ok || (rename(temp.c_str(), path.c_str()) != 0))
+    {
+        unlink(temp.c_str());
+        return false;
+    }
+
+    /// Make rename itself durable
+    size_t slash = path.rfind('/');
+    string dir = (slash == string::npos) ? string(".") : path.substr(0, slash + 1);
+    fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        ::close(fd);
+    }
+    return true;
+}
+
+/// Interval in which appended journal records are written to disk.
+const unsigned int journal_interval_ms = 20;
+
+/// Number of pending records which gets them written before the
+/// interval is over.
+const size_t journal_batch = 1 << 12;
+
+/// Append-only log of bumps of one session. Records are appended to
+/// a memory buffer, and a background thread writes them to file and
+/// syncs it in batches, so appending never waits for disk. Records
+/// appended during last interval before a crash may be lost.
+///
+/// Records are appended by session thread only.
+class Journal
+{
+private:
+    string path;
+    int fd;
+
+    /// Sizes of dictionary the journal is written against
+    unsigned int node_count, word_count;
+
+    /// Sequence number of first record in file
+    unsigned long long base;
+
+    /// Sequence number of next record to be appended
+    unsigned long long next;
+
+    /// Protects pending and stopping
+    mutex lock;
+    condition_variable wake;
+    vector<JournalRecord> pending;
+    bool stopping;
+
+    /// Serializes writes, so records are written in order they were
+    /// taken from pending. Protects fd, writing and failed.
+    mutex write_lock;
+    vector<JournalRecord> writing;
+    bool failed;
+
+    thread flusher;
+
+    /// Write and sync records appended so far.
+    void write_pending(void)
+    {
+        lock_guard<mutex> w(write_lock);
+        {
+            lock_guard<mutex> l(lock);
+            writing.swap(pending);
+        }
+        if (writing.empty())
+            return;
+        if (!write_all(fd, (const char*)&writing[0], writing.size() * sizeof(JournalRecord)) ||
+            (fdatasync(fd) != 0))
+            failed = true;
+        writing.clear();
+    }
+
+    void flush_loop(void)
+    {
+        unique_lock<mutex> l(lock);
+        while (!stopping)
+        {
+            wake.wait_for(l, chrono::milliseconds(journal_interval_ms));
+            l.unlock();
+            write_pending();
+            l.lock();
+        }
+    }
+
+    StateHeader make_header(unsigned long long sequence) const
+    {
+        StateHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, journal_magic, sizeof(h.magic));
+        h.node_count = node_count;
+        h.word_count = word_count;
+        h.sequence = sequence;
+        return h;
+    }
+
+public:
+    Journal(void)
+        :fd(-1), node_count(0), word_count(0), base(0), next(0),
+         stopping(false), failed(false)
+    {}
+
+    ~Journal(void)
+    {
+        close();
+    }
+
+    /// Open journal at path for appending. It must hold given number
+    /// of valid records, the first one with sequence number first.
+    /// Anything after them (a record torn by crash) is dropped. If
+    /// file doesn't exist, an empty journal is created.
+    bool open(const string &p, unsigned int nodes, unsigned int words,
+              unsigned long long first, size_t records)
+    {
+        close();
+        path = p;
+        node_count = nodes;
+        word_count = words;
+        base = first;
+        next = first + records;
+        failed = false;
+
+        fd = ::open(path.c_str(), O_RDWR);
+        if ((fd < 0) && (errno == ENOENT))
+        {
+            StateHeader h = make_header(base);
+            if (!replace_file(path, (const char*)&h, sizeof(h)))
+                return false;
+            fd = ::open(path.c_str(), O_RDWR);
+        }
+        off_t end = sizeof(StateHeader) + records * sizeof(JournalRecord);
+        if ((fd < 0) || (ftruncate(fd, end) != 0) || (lseek(fd, end, SEEK_SET) != end))
+        {
+            close();
+            return false;
+        }
+
+        stopping = false;
+        flusher = thread(&Journal::flush_loop, this);
+        return true;
+    }
+
+    void append(node_index_t v, unsigned int n)
+    {
+        JournalRecord r = {v, n};
+        lock_guard<mutex> l(lock);
+        pending.push_back(r);
+        next++;
+        if (pending.size() == journal_batch)
+            wake.notify_one();
+    }
+
+    /// Write and sync all records appended so far.
+    bool sync(void)
+    {
+        write_pending();
+        lock_guard<mutex> w(write_lock);
+        return !failed;
+    }
+
+    /// @return Sequence number of next record to be appended.
+    unsigned long long end(void) const
+    {
+        return next;
+    }
+
+    /// Start a new empty journal continuing this one, after all its
+    /// records have been saved elsewhere.
+    bool rotate(void)
+    {
+        if (!sync())
+            return false;
+        lock_guard<mutex> w(write_lock);
+        StateHeader h = make_header(next);
+        if (!replace_file(path, (const char*)&h, sizeof(h)))
+            return false;
+        int rotated = ::open(path.c_str(), O_WRONLY | O_APPEND);
+        if (rotated < 0)
+            return false;
+        ::close(fd);
+        fd = rotated;
+        base = next;
+        return true;
+    }
+
+    /// Write remaining records and stop background thread.
+    void close(void)
+    {
+        if (flusher.joinable())
+        {
+            {
+                lock_guard<mutex> l(lock);
+                stopping = true;
+            }
+            wake.notify_one();
+            flusher.join();
+            write_pending();
+        }
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+    }
+};
+
+/// Clock used to time operations for statistics.
+typedef chrono::steady_clock stat_clock;
+
+/// Nanoseconds passed since given time.
+unsigned long long stat_ns(const stat_clock::time_point &since)
+{
+    return chrono::duration_cast<chrono::nanoseconds>(stat_clock::now() - since).count();
+}
+
+/// Histogram of operation latencies with power of two buckets:
+/// bucket i counts operations which took from 2^i to 2^(i+1) - 1
+/// nanoseconds. Takes constant memory, so it may run for the whole
+/// life of a session.
+class LatencyHistogram
+{
+private:
+    static const int bucket_count = 40;
+
+    unsigned long long buckets[bucket_count];
+    unsigned long long count, total_ns, max_ns;
+
+public:
+    LatencyHistogram(void)
+        :count(0), total_ns(0), max_ns(0)
+    {
+        fill(buckets, buckets + bucket_count, 0);
+    }
+
+    void add(unsigned long long ns)
+    {
+        int b = (ns > 1) ? 63 - __builtin_clzll(ns) : 0;
+        buckets[min(b, bucket_count - 1)]++;
+        count++;
+        total_ns += ns;
+        max_ns = max(max_ns, ns);
+    }
+
+    /// Upper bound of q-quantile (bound of its bucket).
+    unsigned long long quantile(double q) const
+    {
+        unsigned long long seen = 0;
+        for (int b = 0; b < bucket_count; b++)
+        {
+            seen += buckets[b];
+            if ((seen > 0) && (seen >= q * count))
+                return min((2ULL << b) - 1, max_ns);
+        }
+        return max_ns;
+    }
+
+    void print(ostream &out, bool json) const
+    {
+        double mean = count ? (double)total_ns / count : 0;
+        if (json)
+        {
+            out << "{\"count\": " << count << ", \"mean_ns\": " << mean
+                << ", \"p50_ns\": " << quantile(0.5) << ", \"p99_ns\": " << quantile(0.99)
+                << ", \"max_ns\": " << max_ns << ", \"buckets\": [";
+            for (int b = 0, first = 1; b < bucket_count; b++)
+                if (buckets[b] != 0)
+                {
+                    out << (first ? "" : ", ") << "[" << (1ULL << b) << ", " << buckets[b] << "]";
+                    first = 0;
+                }
+            out << "]}";
+        }
+        else
+        {
+            out << "count " << count << ", mean " << mean << " ns, p50 <= " << quantile(0.5)
+                << " ns, p99 <= " << quantile(0.99) << " ns, max " << max_ns << " ns";
+        }
+    }
+};
+
+/// Prints statistics as lines "name value" or as JSON object.
+class StatsWriter
+{
+private:
+    ostream &out;
+    bool json;
+    string indent;
+    bool first;
+
+public:
+    StatsWriter(ostream &o, bool j)
+        :out(o), json(j), first(true)
+    {}
+
+    void begin(const char *name = NULL)
+    {
+        if (json)
+        {
+            out << (first ? "" : ", ");
+            if (name != NULL)
+                out << "\"" << name << "\": ";
+            out << "{";
+        }
+        else if (name != NULL)
+        {
+            out << indent << name << ":" << endl;
+            indent += "  ";
+        }
+        first = true;
+    }
+
+    void end(void)
+    {
+        if (json)
+            out << "}";
+        else if (!indent.empty())
+            indent.resize(indent.size() - 2);
+        first = false;
+    }
+
+    void field(const char *name, unsigned long long value)
+    {
+        if (json)
+            out << (first ? "" : ", ") << "\"" << name << "\": " << value;
+        else
+            out << indent << name << " " << value << endl;
+        first = false;
+    }
+
+    void field(const char *name, const LatencyHistogram &h)
+    {
+        if (json)
+            out << (first ? "" : ", ") << "\"" << name << "\": ";
+        else
+            out << indent << name << " ";
+        h.print(out, json);
+        if (!json)
+            out << endl;
+        first = false;
+    }
+};
+
+/// Counters of Trie operations, collected with T9_STATS.
+struct TrieStats
+{
+    unsigned long long queries;
+
+    /// Total and greatest trie depth (key length) of queries
+    unsigned long long depth, max_depth;
+
+    /// Overlay tree nodes visited and binary searches of dictionary
+    /// word ranges made by queries
+    unsigned long long tree_nodes, base_searches;
+
+    unsigned long long first_bumps, rebumps;
+
+    /// Allocations of overlays, completion lists and tree nodes
+    unsigned long long allocations;
+
+    unsigned long long completions;
+
+    LatencyHistogram query_ns, complete_ns;
+
+    TrieStats(void)
+        :queries(0), depth(0), max_depth(0), tree_nodes(0), base_searches(0),
+         first_bumps(0), rebumps(0), allocations(0), completions(0)
+    {}
+
+    void print(StatsWriter &out) const
+    {
+        out.begin("trie");
+        out.field("queries", queries);
+        out.field("depth", depth);
+        out.field("max_depth", max_depth);
+        out.field("tree_nodes", tree_nodes);
+        out.field("base_searches", base_searches);
+        out.field("first_bumps", first_bumps);
+        out.field("rebumps", rebumps);
+        out.field("allocations", allocations);
+        out.field("completions", completions);
+        out.field("query_ns", query_ns);
+        out.field("complete_ns", complete_ns);
+        out.end();
+    }
+};
+
+/// Trie class to effectively store words under numerical keys as
+/// given by cell phone keyboard mapping. Words can be queried from
+/// trie by keys using Trie::query. Whenever a word is queried, its
+/// frequency is increased by one except it's a punctuation mark.
+///
+/// Nodes and words are read directly from compiled Dictionary, which
+/// is never modified, so any number of tries (one per input session)
+/// may share one dictionary and be used from different threads
+/// without locking. Trie itself only keeps a small overlay with
+/// words bumped through it.
+template <class Layout>
+class Trie
+{
+private:
+    /// Words bumped under some trie node.
+    struct Overlay
+    {
+        /// Bumped words with their current ranks
+        rank_index_t bumped;
+
+        /// Same words with their initial ranks. These are skipped
+        /// when words are taken from dictionary.
+        rank_index_t moved;
+
+        Overlay(void)
+            :bumped(0), moved(0)
+        {}
+    };
+
+    /// Counts dictionary words of node which haven't been bumped and
+    /// are ranked before given rank.
+    class BaseCounter
+    {
+    private:
+        const Dictionary<Layout> &dict;
+        const TrieNode<Layout> &node;
+        const word_forest &ranks;
+        rank_index_t moved;
+        unsigned long long &searches;
+
+    public:
+        BaseCounter(const Dictionary<Layout> &d, const TrieNode<Layout> &v,
+                    const word_forest &f, rank_index_t m, unsigned long long &s)
+            :dict(d), node(v), ranks(f), moved(m), searches(s)
+        {}
+
+        size_t operator ()(const Rank &r) const
+        {
+            T9_STAT(searches++);
+            return dict.count_before(node, r) - ranks.count_before(moved, r);
+        }
+    };
+
+    /// Word with its rank in this trie.
+    struct Completion
+    {
+        Rank rank;
+        word_index_t word;
+
+        Completion(const Rank &r, word_index_t w)
+            :rank(r), word(w)
+        {}
+    };
+
+    /// Completion list of node, stored at index * completion_count
+    /// in completion pool.
+    struct CompletionSlot
+    {
+        node_index_t node;
+        unsigned int size;
+    };
+
+    /// Number of completion lists room is reserved for up front.
+    /// Bumping a word of key with length L touches L + 1 lists.
+    static const size_t reserved_lists = 64;
+
+    const Dictionary<Layout> &dict;
+
+    /// Ranked words of overlays
+    word_forest ranks;
+
+    /// Overlays of trie nodes with bumped words
+    unordered_map<node_index_t, Overlay> overlay;
+
+    /// Completion lists of nodes which have had words bumped under
+    /// them or their descendants, each taking completion_count
+    /// entries of pool. Other nodes use lists from dictionary.
+    vector<Completion> completion_pool;
+    vector<CompletionSlot> completion_lists;
+
+    /// Open addressing table of completion list indices plus 1 (0 is
+    /// free entry) by node. Kept at most half full, so the first
+    /// bump under a node only allocates when the table doubles.
+    vector<unsigned int> completion_index;
+
+    /// Stamp given to word most recently bumped to front of its
+    /// frequency.
+    stamp_t front_stamp;
+
+    mutable TrieStats stats;
+
+    /// Get entry of completion index where node v is or would be
+    /// stored.
+    size_t completion_entry(node_index_t v) const
+    {
+        size_t mask = completion_index.size() - 1;
+        size_t e = (v * 2654435761u) & mask;
+        while ((completion_index[e] != 0) &&
+               (completion_lists[completion_index[e] - 1].node != v))
+            e = (e + 1) & mask;
+        return e;
+    }
+
+    /// Get index of completion list of node v, copying the list from
+    /// dictionary if node has none yet.
+    size_t get_completion_list(node_index_t v)
+    {
+        size_t e = completion_entry(v);
+        if (completion_index[e] != 0)
+            return completion_index[e] - 1;
+
+        size_t l = completion_lists.size();
+        T9_STAT(stats.allocations += (l == completion_lists.capacity()));
+        CompletionSlot slot = {v, 0};
+        const word_index_t *base = dict.get_completions(v);
+        for (; (slot.size < completion_count) && (base[slot.size] != no_word); slot.size++)
+            completion_pool.push_back(Completion(dict.get_rank(base[slot.size]), base[slot.size]));
+        completion_pool.resize((l + 1) * completion_count, Completion(Rank(0, 0), no_word));
+        completion_lists.push_back(slot);
+
+        if (2 * completion_lists.size() > completion_index.size())
+        {
+            completion_index.assign(2 * completion_index.size(), 0);
+            for (size_t i = 0; i < completion_lists.size(); i++)
+                completion_index[completion_entry(completion_lists[i].node)] = i + 1;
+        }
+        else
+            completion_index[e] = l + 1;
+        return l;
+    }
+
+    /// Put word w with new rank r to completion list of node v if
+    /// it's among the most frequent ones.
+    ///
+    /// Ranks only grow, so a word which is not in the list may only
+    /// get there when it's bumped, which makes this update exact.
+    void update_completions(node_index_t v, word_index_t w, const Rank &r)
+    {
+        size_t l = get_completion_list(v);
+        Completion *list = &completion_pool[l * completion_count];
+        unsigned int &size = completion_lists[l].size;
+
+        Completion *i = find_if(list, list + size,
+                                [w](const Completion &c) { return c.word == w; });
+        if (i != list + size)
+        {
+            copy(i + 1, list + size, i);
+            size--;
+        }
+        else if (size == completion_count)
+        {
+            if (!(r < list[size - 1].rank))
+                return;
+            size--;
+        }
+
+        for (i = list; (i != list + size) && ((i->rank) < r); i++);
+        copy_backward(i, list + size, list + size + 1);
+        *i = Completion(r, w);
+        size++;
+    }
+
+    /// Update completion lists of all nodes on path to key of word w
+    /// which got new rank r.
+    void learn(word_index_t w, const Rank &r)
+    {
+        Word word = dict.get_word(w);
+        node_index_t v = 0;
+        update_completions(v, w, r);
+        for (const char *c = word.str; c != word.str + word.length;)
+        {
+            v = dict.node(v).children[Layout::key(c, word.str + word.length)];
+            update_completions(v, w, r);
+        }
+    }
+
+    /// Journal of bumps, if they are recorded
+    Journal *journal;
+
+    /// True if node v exists and has n-th word, so that its bump can
+    /// be replayed.
+    bool valid_bump(node_index_t v, unsigned int n) const
+    {
+        return (v < dict.node_count()) && (n < dict.node(v).count);
+    }
+
+    /// Write bump of n-th word of node v to journal, if bumps are
+    /// recorded. Bumps which replay would reject are never written,
+    /// so they can't make the journal unrecoverable.
+    void record(node_index_t v, unsigned int n)
+    {
+        if ((journal != NULL) && valid_bump(v, n))
+            journal->append(v, n);
+    }
+
+public:
+    Trie(const Dictionary<Layout> &d)
+        :dict(d), completion_index(2 * reserved_lists, 0), front_stamp(0), journal(NULL)
+    {
+        completion_pool.reserve(reserved_lists * completion_count);
+        completion_lists.reserve(reserved_lists);
+    }
+
+    const Dictionary<Layout>& get_dictionary(void) const
+    {
+        return dict;
+    }
+
+    /// Record every bump to journal j from now on (or stop recording
+    /// if it's NULL).
+    void set_journal(Journal *j)
+    {
+        journal = j;
+    }
+
+    /// Get n-th word stored in trie under given full key.
+    ///
+    /// Candidates are dictionary words of the key which haven't been
+    /// bumped yet merged with overlay words, both in rank order. The
+    /// n-th one is found by descending overlay trees, which takes
+    /// O(log^2) time and doesn't depend on words count.
+    ///
+    /// @return Empty word if no word has this key.
+    Word query(const string &full_key, int n = 0)
+    {
+        T9_STAT(stat_clock::time_point start = stat_clock::now());
+        node_index_t v;
+        Word w = dict.find_node(full_key.c_str(), v) ? query(v, n) : Word("", 0, false);
+        T9_STAT(stats.query_ns.add(stat_ns(start)));
+        T9_STAT(stats.queries++);
+        T9_STAT(stats.depth += full_key.size());
+        T9_STAT(stats.max_depth = max<unsigned long long>(stats.max_depth, full_key.size()));
+        return w;
+    }
+
+    /// Get n-th word stored under leaf node v. Skipping past the last
+    /// candidate wraps around to the first one.
+    ///
+    /// @return Empty word if node has no words.
+    Word query(node_index_t v, unsigned int n)
+    {
+        const TrieNode<Layout> &node = dict.node(v);
+        if (node.count == 0)
+            return Word("", 0, false);
+        n %= node.count;
+
+        typename unordered_map<node_index_t, Overlay>::iterator o = overlay.find(v);
+        word_index_t w;
+
+        if (o == overlay.end())
+            w = node.first + n;
+        else
+        {
+            Overlay &ov = o->second;
+            bool found;
+            size_t j = ranks.merge_select(ov.bumped, n,
+                                          BaseCounter(dict, node, ranks, ov.moved,
+                                                      stats.base_searches),
+                                          found);
+            if (found)
+            {
+                /// Bump again
+                Rank r(ranks.rank_at(ov.bumped, j).freq + 1, ++front_stamp);
+                w = ranks.move(ov.bumped, j, r);
+                learn(w, r);
+                T9_STAT(stats.rebumps++);
+                record(v, n);
+                return dict.get_word(w);
+            }
+            w = ranks.select_missing(ov.moved, node.first, n - j);
+        }
+
+        /// Bump frequency for the first time and move word from
+        /// dictionary to overlay in front of words with the same new
+        /// frequency
+        if (dict.entry(w).bumpable)
+        {
+            Overlay &ov = (o == overlay.end()) ? overlay[v] : o->second;
+            T9_STAT(stats.allocations += (o == overlay.end()));
+            T9_STAT(stats.first_bumps++);
+            Rank r(dict.entry(w).freq + 1, ++front_stamp);
+            ranks.insert(ov.moved, w, dict.get_rank(w));
+            ranks.insert(ov.bumped, w, r);
+            learn(w, r);
+            record(v, n);
+        }
+
+        return dict.get_word(w);
+    }
+
+    /// Store current ranks of all bumped words in out.
+    stamp_t save(vector<LearnedWord> &out) const
+    {
+        out.clear();
+        for (typename unordered_map<node_index_t, Overlay>::const_iterator o = overlay.begin();
+             o != overlay.end(); o++)
+        {
+            for (word_forest::iterator i = ranks.begin(o->second.bumped); i != ranks.end(); i++)
+            {
+                LearnedWord l = {o->first, *i, i.rank().freq, i.rank().stamp};
+                out.push_back(l);
+            }
+        }
+        return front_stamp;
+    }
+
+    /// Give words ranks saved by Trie::save in a fresh trie.
+    ///
+    /// @return False if saved words don't match dictionary.
+    bool restore(const LearnedWord *saved, size_t count, stamp_t front)
+    {
+        for (const LearnedWord *l = saved; l != saved + count; l++)
+        {
+            if ((l->node >= dict.node_count()) ||
+                (l->word < dict.node(l->node).first) ||
+                (l->word - dict.node(l->node).first >= dict.node(l->node).count) ||
+                !dict.entry(l->word).bumpable)
+                return false;
+
+            Overlay &ov = overlay[l->node];
+            Rank r(l->freq, l->stamp);
+            ranks.insert(ov.moved, l->word, dict.get_rank(l->word));
+            ranks.insert(ov.bumped, l->word, r);
+            learn(l->word, r);
+        }
+        front_stamp = front;
+        return true;
+    }
+
+    /// Repeat bump recorded in journal.
+    ///
+    /// @return False if record doesn't match dictionary.
+    bool replay(const JournalRecord &r)
+    {
+        if (!valid_bump(r.node, r.n))
+            return false;
+        query(r.node, r.n);
+        return true;
+    }
+
+    /// Get at most k (and no more than completion_count) most
+    /// frequent words which have keys starting with given prefix.
+    /// Frequencies are not changed. Takes O(prefix length + k) time.
+    ///
+    /// @return Number of words stored in out.
+    size_t complete(const string &prefix, size_t k, vector<Word> &out) const
+    {
+        T9_STAT(stat_clock::time_point start = stat_clock::now());
+        T9_STAT(stats.completions++);
+        node_index_t v;
+        out.clear();
+        if (!dict.find_node(prefix.c_str(), v))
+            return 0;
+        k = min<size_t>(k, completion_count);
+
+        unsigned int l = completion_index[completion_entry(v)];
+        if (l != 0)
+        {
+            const Completion *list = &completion_pool[(l - 1) * completion_count];
+            for (size_t j = 0; (j < k) && (j < completion_lists[l - 1].size); j++)
+                out.push_back(dict.get_word(list[j].word));
+        }
+        else
+        {
+            const word_index_t *base = dict.get_completions(v);
+            for (size_t j = 0; (j < k) && (base[j] != no_word); j++)
+                out.push_back(dict.get_word(base[j]));
+        }
+        T9_STAT(stats.complete_ns.add(stat_ns(start)));
+        return out.size();
+    }
+
+    /// Get statistics of this trie (all zero without T9_STATS).
+    TrieStats get_stats(void) const
+    {
+        TrieStats s = stats;
+        s.tree_nodes = ranks.visited();
+        s.allocations += ranks.reallocations();
+        return s;
+    }
+};
+
+/// Number of journal records after which a new snapshot is taken.
+const unsigned long long checkpoint_interval = 1 << 20;
+
+/// Keeps frequencies learned by a session durable across restarts.
+/// Every bump is appended to journal PREFIX.journal, and from time to
+/// time all learned ranks are saved to a compact snapshot
+/// PREFIX.snapshot, after which the journal starts over. On restart
+/// the snapshot is loaded and only journal records which came after
+/// it are replayed.
+///
+/// Snapshot is replaced atomically, and records it covers are
+/// skipped by sequence number, so a crash at any point leaves a
+/// consistent state.
+template <class Layout>
+class FrequencyStore
+{
+private:
+    Trie<Layout> &trie;
+    string snapshot_path;
+    Journal journal;
+
+    /// Sequence number of first journal record not in snapshot
+    unsigned long long saved;
+
+    bool check_header(const StateHeader &h, const char *magic) const
+    {
+        const Dictionary<Layout> &dict = trie.get_dictionary();
+        return !memcmp(h.magic, magic, sizeof(h.magic)) &&
+            (h.node_count == dict.node_count()) && (h.word_count == dict.word_count());
+    }
+
+    /// Load snapshot if there is any.
+    bool load_snapshot(void)
+    {
+        saved = 0;
+        if (access(snapshot_path.c_str(), F_OK) != 0)
+            return true;
+
+        MappedFile file;
+        if (!file.open(snapshot_path.c_str()) || (file.size() < sizeof(StateHeader)))
+            return false;
+        const StateHeader &h = *(const StateHeader*)file.data();
+        if (!check_header(h, snapshot_magic) ||
+            (file.size() != sizeof(h) + h.count * sizeof(LearnedWord)))
+            return false;
+        saved = h.sequence;
+        return trie.restore((const LearnedWord*)(file.data() + sizeof(h)), h.count, h.front_stamp);
+    }
+
+    /// Replay journal records which are not in snapshot and open
+    /// journal for appending. Journal is cut at the first record which
+    /// doesn't match dictionary, so one bad record doesn't prevent
+    /// every later start; bumps recorded after it are lost.
+    bool replay_journal(const string &path)
+    {
+        unsigned long long first = saved;
+        size_t records = 0;
+
+        MappedFile file;
+        if (file.open(path.c_str()))
+        {
+            if (file.size() < sizeof(StateHeader))
+                return false;
+            const StateHeader &h = *(const StateHeader*)file.data();
+            /// Records between snapshot and journal are missing
+            if (!check_header(h, journal_magic) || (h.sequence > saved))
+                return false;
+
+            first = h.sequence;
+            records = (file.size() - sizeof(h)) / sizeof(JournalRecord);
+            const JournalRecord *r = (const JournalRecord*)(file.data() + sizeof(h));
+            for (size_t i = 0; i < records; i++)
+            {
+                if ((first + i >= saved) && !trie.replay(r[i]))
+                {
+                    records = i;
+                    break;
+                }
+            }
+
+            /// All records are in snapshot, start over
+            if (first + records < saved)
+            {
+                unlink(path.c_str());
+                first = saved;
+                records = 0;
+            }
+        }
+        else if (access(path.c_str(), F_OK) == 0)
+            return false;
+
+        const Dictionary<Layout> &dict = trie.get_dictionary();
+        return journal.open(path, dict.node_count(), dict.word_count(), first, records);
+    }
+
+public:
+    FrequencyStore(Trie<Layout> &t)
+        :trie(t), saved(0)
+    {}
+
+    ~FrequencyStore(void)
+    {
+        close();
+    }
+
+    /// Restore learned frequencies from files with given prefix and
+    /// record further bumps in them. Trie must be fresh.
+    bool open(const string &prefix)
+    {
+        snapshot_path = prefix + ".snapshot";
+        if (!load_snapshot() || !replay_journal(prefix + ".journal"))
+            return false;
+        trie.set_journal(&journal);
+        return true;
+    }
+
+    /// Save all learned ranks to snapshot and start new journal.
+    bool checkpoint(void)
+    {
+        if (!journal.sync())
+            return false;
+
+        vector<LearnedWord> words;
+        StateHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, snapshot_magic, sizeof(h.magic));
+        h.node_count = trie.get_dictionary().node_count();
+        h.word_count = trie.get_dictionary().word_count();
+        h.sequence = journal.end();
+        h.front_stamp = trie.save(words);
+        h.count = words.size();
+
+        vector<char> data(sizeof(h) + words.size() * sizeof(LearnedWord));
+        memcpy(&data[0], &h, sizeof(h));
+        if (!words.empty())
+            memcpy(&data[sizeof(h)], &words[0], words.size() * sizeof(LearnedWord));
+        if (!replace_file(snapshot_path, &data[0], data.size()))
+            return false;
+        saved = h.sequence;
+        return journal.rotate();
+    }
+
+    /// Take snapshot if journal has grown long enough since last one.
+    /// Called between queries, so that snapshots don't delay them.
+    bool maybe_checkpoint(void)
+    {
+        if (journal.end() - saved < checkpoint_interval)
+            return true;
+        return checkpoint();
+    }
+
+    /// Write remaining journal records and stop recording bumps.
+    void close(void)
+    {
+        trie.set_journal(NULL);
+        journal.close();
+    }
+};
+
+/// Size of chunks in which input is read and output is written.
+const size_t chunk_size = 1 << 16;
+
+/// Buffered output to file descriptor or string.
+class OutputSink
+{
+private:
+    int fd;
+
+    /// If not NULL, output is appended to this string directly
+    string *target;
+
+    vector<char> buffer;
+    size_t used;
+
+public:
+    OutputSink(int f = 1)
+        :fd(f), target(NULL), buffer(chunk_size), used(0)
+    {}
+
+    OutputSink(string *s)
+        :fd(-1), target(s), used(0)
+    {}
+
+    ~OutputSink(void)
+    {
+        flush();
+    }
+
+    void write(const char *data, size_t length)
+    {
+        if (target != NULL)
+        {
+            target->append(data, length);
+            return;
+        }
+        while (length > 0)
+        {
+            if (used == buffer.size())
+                flush();
+            size_t part = min(length, buffer.size() - used);
+            memcpy(&buffer[used], data, part);
+            used += part;
+            data += part;
+            length -= part;
+        }
+    }
+
+    void put(char c)
+    {
+        if (target != NULL)
+        {
+            target->push_back(c);
+            return;
+        }
+        if (used == buffer.size())
+            flush();
+        buffer[used++] = c;
+    }
+
+    void flush(void)
+    {
+        const char *data = &buffer[0];
+        while (used > 0)
+        {
+            ssize_t written = ::write(fd, data, used);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                /// Nowhere to report this, drop output.
+                break;
+            }
+            data += written;
+            used -= written;
+        }
+        used = 0;
+    }
+};
+
+/// Counters of T9Reader, collected with T9_STATS.
+struct ReaderStats
+{
+    unsigned long long words, chunks, bytes;
+
+    /// Time to resolve and print a word, and to decode a chunk
+    LatencyHistogram word_ns, chunk_ns;
+
+    ReaderStats(void)
+        :words(0), chunks(0), bytes(0)
+    {}
+
+    void print(StatsWriter &out) const
+    {
+        out.begin("reader");
+        out.field("words", words);
+        out.field("chunks", chunks);
+        out.field("bytes", bytes);
+        out.field("word_ns", word_ns);
+        out.field("chunk_ns", chunk_ns);
+        out.end();
+    }
+};
+
+/// Set by signal handler when statistics are requested.
+volatile sig_atomic_t stats_requested = 0;
+
+void request_stats(int)
+{
+    stats_requested = 1;
+}
+
+/// Decodes SMS input incrementally. Input may be fed in chunks of
+/// any size (tokens may be split between chunks), and every word is
+/// written to output sink as soon as it's resolved, so memory use
+/// doesn't depend on input length.
+template <class Layout>
+class T9Reader
+{
+private:
+    string full_key;
+    bool prev_punct, word_put;
+    int skips;
+
+    /// Line breaks read but not written yet. They are written only
+    /// if more output follows, so last line doesn't get one.
+    int newlines;
+
+    /// Frequencies learned in this session
+    Trie<Layout> trie;
+
+    OutputSink *out;
+
+    /// Store of learned frequencies, if they are kept durable
+    FrequencyStore<Layout> *store;
+
+    ReaderStats stats;
+
+    /// Stream to print requested statistics to, if any
+    ostream *stats_out;
+    bool stats_json;
+
+    /// If word selected so far has not been printed yet, do it
+    void put_pending(void)
+    {
+        if (!word_put)
+            put_current_word();
+    }
+
+    void put_newlines(void)
+    {
+        for (; newlines; newlines--)
+            out->put('\n');
+    }
+
+    /// Print statistics if they've been requested since last time.
+    void poll_stats(void)
+    {
+        if ((stats_out != NULL) && stats_requested)
+        {
+            stats_requested = 0;
+            print_stats(*stats_out, stats_json);
+        }
+    }
+
+    /// Flush output and do periodic work between chunks of input.
+    void end_chunk(void)
+    {
+        out->flush();
+        if (store != NULL)
+            store->maybe_checkpoint();
+        poll_stats();
+    }
+
+public:
+    T9Reader(const Dictionary<Layout> &dict, OutputSink *o)
+        :trie(dict)
+    {
+        out = o;
+        store = NULL;
+        stats_out = NULL;
+        stats_json = false;
+        full_key = "";
+        word_put = true;
+        prev_punct = false;
+        skips = 0;
+        newlines = 0;
+    }
+
+    Trie<Layout>& get_trie(void)
+    {
+        return trie;
+    }
+
+    /// Take snapshots of learned frequencies to store s between
+    /// chunks of input.
+    void set_store(FrequencyStore<Layout> *s)
+    {
+        store = s;
+    }
+
+    /// Print statistics to stream o whenever they are requested with
+    /// a signal (see request_stats), in JSON if json is true.
+    void report_stats(ostream *o, bool json)
+    {
+        stats_out = o;
+        stats_json = json;
+    }
+
+    /// Print statistics of reader and its trie (all zero without
+    /// T9_STATS).
+    void print_stats(ostream &o, bool json) const
+    {
+        StatsWriter w(o, json);
+        w.begin();
+        if (!stats_enabled)
+            w.field("disabled", 1);
+        stats.print(w);
+        trie.get_stats().print(w);
+        w.end();
+        if (json)
+            o << endl;
+        o.flush();
+    }
+
+    /// Print word selected so far
+    void put_current_word(void)
+    {
+        T9_STAT(stat_clock::time_point start = stat_clock::now());
+        put_newlines();
+        Word w = trie.query(full_key, skips);
+        out->write(w.str, w.length);
+        T9_STAT(stats.word_ns.add(stat_ns(start)));
+        T9_STAT(stats.words++);
+        full_key.clear();
+        skips = 0;
+        word_put = true;
+        prev_punct = false;
+    }
+
+    /// Read part of SMS input with digits, spaces and asterisk signs
+    /// and print out words selected so far.
+    void feed(const char *input, size_t length)
+    {
+        T9_STAT(stat_clock::time_point start = stat_clock::now());
+        T9_STAT(stats.chunks++);
+        T9_STAT(stats.bytes += length);
+        for (const char *i = input; i != input + length; i++)
+        {
+            if (*i == ' ')
+            {
+                put_pending();
+                put_newlines();
+                out->put(' ');
+            }
+            else if (*i == '\n')
+            {
+                put_pending();
+                newlines++;
+            }
+            else
+            {
+                int key = Layout::key_table[*i];
+                /// Next character in word key
+                if (key > 0)
+                {
+                    if (prev_punct)
+                        put_pending();
+                    full_key += *i;
+                    word_put = false;
+                }
+                else if (*i == '*')
+                    skips++;
+                /// Punctuation (put word)
+                else if (key == 0)
+                {
+                    put_pending();
+                    full_key.assign(1, *i);
+                    word_put = false;
+                    prev_punct = true;
+                }
+            }
+        }
+        T9_STAT(stats.chunk_ns.add(stat_ns(start)));
+    }
+
+    /// Get at most k most frequent words which may be typed by
+    /// continuing key of current word.
+    size_t suggest(size_t k, vector<Word> &out) const
+    {
+        return trie.complete(full_key, k, out);
+    }
+
+    /// Print last word when input is over.
+    void finish(void)
+    {
+        put_pending();
+        out->flush();
+    }
+
+    /// Read whole SMS input and print out words selected.
+    void read(const string &input)
+    {
+        feed(input.data(), input.size());
+        finish();
+    }
 
-    void print() const
+    /// Read SMS input which starts in buffer of stream in (after
+    /// dictionary was read from it) and continues in its file
+    /// descriptor fd. Buffered input is decoded first, then the rest
+    /// is read from fd directly, because reads of standard streams
+    /// retry when interrupted by a signal and so never let
+    /// statistics be printed while waiting for input.
+    void read(istream &in, int fd)
     {
-        cout << str;
+        vector<char> chunk(chunk_size);
+        streamsize length;
+        while ((length = in.readsome(&chunk[0], chunk.size())) > 0)
+        {
+            feed(&chunk[0], length);
+            end_chunk();
+        }
+        read(fd);
     }
 
-    void send(ostream &out)
+    /// Read SMS input from file descriptor until end of file,
+    /// flushing output after every chunk.
+    void read(int fd)
     {
-        out << str;
+        vector<char> chunk(chunk_size);
+        ssize_t length;
+        while ((length = ::read(fd, &chunk[0], chunk.size())) != 0)
+        {
+            if (length < 0)
+            {
+                if (errno == EINTR)
+                {
+                    poll_stats();
+                    continue;
+                }
+                break;
+            }
+            feed(&chunk[0], length);
+            end_chunk();
+        }
+        finish();
     }
 };
 
-ostream& operator <<(ostream &out, Word &w)
-{
-    w.send(out);
-    return out;
-}
-
-typedef list<Word> word_list;
-
-/// Insert new word into word list wrt frequency
-///
-/// @param bump If true, word is inserted in the beginning of list.
-///             Otherwise, it's appended after all other items.
+/// Decodes many independent SMS inputs in parallel. Every input is
+/// a separate session with its own learned frequencies, so results
+/// are the same as if inputs were decoded one after another by fresh
+/// readers.
 ///
-/// @return List beginning iterator.
-word_list::iterator insert_word(word_list &l, const Word &w, bool bump = false)
-{
-    if (bump)
-        l.push_front(w);
-    else
-        l.push_back(w);
-    return l.begin();
-}
-
-template <class Label, class Data>
-class BinaryTree
+/// Inputs are split between worker threads in contiguous ranges.
+/// Every worker takes inputs from the back of its own queue, and when
+/// it runs dry, steals from the front of queues of other workers.
+template <class Layout>
+class BatchDecoder
 {
 private:
+    struct TaskQueue
+    {
+        mutex lock;
+        deque<size_t> tasks;
+    };
 
+    const Dictionary<Layout> &dict;
+    unsigned int threads;
 
-    /// Data stored in this node
-    Data data;
-    
-    BinaryTree *prev, *next;
-public:
-    /// Node label
-    const Label label;
-    
-    /// STL-style input in-order iterator for tree.
-    class iterator {
-    private:
-        /// Standard traits.
-        typedef input_iterator_tag iterator_category;
-        typedef Data& value_type;
-        typedef ptrdiff_t distance_type;
-
-        /// Tree we iterate over
-        BinaryTree *tree;
-
-        /// Traversal stack
-        stack<BinaryTree*> iter_stack;
+    const vector<string> *inputs;
+    vector<string> *results;
+    vector<TaskQueue> queues;
 
-    public:
-        /// @param end If true, create end iterator
-        iterator(BinaryTree *ptr, bool end = false)
-            :tree(ptr)
+    /// Take next task for worker i.
+    ///
+    /// @return false if no tasks are left in any queue.
+    bool take(unsigned int i, size_t &task)
+    {
         {
-            if (!end)
-                while (ptr != NULL)
-                {
-                    iter_stack.push(ptr);
-                    ptr = ptr->prev;
-                }
+            lock_guard<mutex> guard(queues[i].lock);
+            if (!queues[i].tasks.empty())
+            {
+                task = queues[i].tasks.back();
+                queues[i].tasks.pop_back();
+                return true;
+            }
         }
 
-        iterator& operator ++(int)
+        for (size_t k = 1; k < queues.size(); k++)
         {
-            BinaryTree *ptr = iter_stack.top();
-            iter_stack.pop();
-            ptr = ptr->next;
-            while (ptr != NULL)
+            TaskQueue &victim = queues[(i + k) % queues.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty())
             {
-                iter_stack.push(ptr);
-                ptr = ptr->prev;
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
             }
-            return *this;
         }
+        return false;
+    }
 
-        iterator& operator ++(void)
+    void work(unsigned int i)
+    {
+        size_t task;
+        while (take(i, task))
         {
-            *this++;
-            return *this;
+            OutputSink out(&(*results)[task]);
+            T9Reader<Layout> reader(dict, &out);
+            reader.read((*inputs)[task]);
         }
+    }
 
-        bool operator==(iterator iter)
-        {
-            return (tree == iter.tree && iter_stack == iter.iter_stack);
-        }
-        
-        bool operator !=(iterator iter)
-        {
-            return !(tree != iter.tree || iter_stack != iter.iter_stack);
-        }
+public:
+    /// @param t Number of worker threads (at least 1)
+    BatchDecoder(const Dictionary<Layout> &d, unsigned int t)
+        :dict(d), threads(max(t, 1u)), inputs(NULL), results(NULL)
+    {}
 
-        Data& operator *(void)
-        {
-            return iter_stack.top()->data;
-        }
+    /// Decode every input as a separate session. Results are stored
+    /// in input order.
+    void decode(const vector<string> &in, vector<string> &out)
+    {
+        inputs = &in;
+        results = &out;
+        out.assign(in.size(), string());
+
+        unsigned int workers = min<size_t>(threads, max<size_t>(in.size(), 1));
+        vector<TaskQueue> q(workers);
+        queues.swap(q);
+        for (size_t task = 0; task < in.size(); task++)
+            queues[task * workers / in.size()].tasks.push_back(task);
+
+        vector<thread> pool;
+        for (unsigned int i = 1; i < workers; i++)
+            pool.push_back(thread(&BatchDecoder::work, this, i));
+        work(0);
+        for (vector<thread>::iterator i = pool.begin(); i != pool.end(); i++)
+            i->join();
+    }
+};
 
-        /// @return Label of node that iterator currently points at.
-        const Label& label(void)
+/// Number of inputs decoded at once in batch mode.
+const size_t batch_size = 1 << 14;
+
+/// Read lines from stream, decode each one as a separate session and
+/// print results in the same order, one per line.
+template <class Layout>
+void decode_lines(istream &in, const Dictionary<Layout> &dict, unsigned int threads)
+{
+    BatchDecoder<Layout> decoder(dict, threads);
+    OutputSink out;
+    vector<string> inputs, results;
+    string line;
+
+    while (in)
+    {
+        inputs.clear();
+        while ((inputs.size() < batch_size) && getline(in, line))
+            inputs.push_back(line);
+        if (inputs.empty())
+            break;
+
+        decoder.decode(inputs, results);
+        for (vector<string>::iterator i = results.begin(); i != results.end(); i++)
         {
-            return iter_stack.top()->label;
+            out.write(i->data(), i->size());
+            out.put('\n');
         }
-    };
-    
-    
-    BinaryTree(Label l)
-        :prev(NULL), next(NULL), label(l)
-    {}
-    
-    ~BinaryTree(void)
+        out.flush();
+    }
+}
+
+/// Synthetic workload for benchmarks and load generation.
+///
+/// Letters and lengths of words follow English distributions, which
+/// gives realistic key collisions. Word frequencies and choice of
+/// queried words follow Zipf's law, with word 0 being most frequent.
+/// Word i depends only on seed and i, so queries can be generated
+/// without keeping all words in memory.
+class Workload
+{
+private:
+    size_t words;
+
+    /// Zipf's law exponent
+    double zipf;
+
+    /// Mean number of asterisks after key (limited by number of words
+    /// under the key)
+    double skip_depth;
+
+    unsigned long long seed, state;
+
+    /// Cumulative weights of letters a to z
+    vector<unsigned int> letters;
+
+    /// Cumulative weights of word lengths 1, 2, ...
+    vector<unsigned int> lengths;
+
+    static unsigned long long splitmix(unsigned long long &x)
     {
-        if (prev != NULL)
-            delete prev;
-        if (next != NULL)
-            delete next;
-    }    
+        unsigned long long z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
 
-    iterator begin(void)
+    /// Uniform random number in [0, 1).
+    double uniform(void)
     {
-        return iterator(this);
+        return (splitmix(state) >> 11) * (1.0 / 9007199254740992.0);
     }
 
-    iterator end(void)
+    /// Pick index according to cumulative weights.
+    static size_t pick(const vector<unsigned int> &cumulative, unsigned long long r)
     {
-        return iterator(this, true);
+        return upper_bound(cumulative.begin(), cumulative.end(),
+                           r % cumulative.back()) - cumulative.begin();
     }
 
-    /// Get data under node with given label, creating it if needed.
-    ///
-    /// @todo Rewrite iteratively.
-    Data& get_data(const Label l)
+    static vector<unsigned int> accumulate(const unsigned int *weights, size_t n)
     {
-        if (l == label)
-            return data;
-        else
-        {
-            BinaryTree<Label, Data> *&ptr = (l < label) ? next : prev;
-            
-            if (ptr == NULL)
-                ptr = new BinaryTree(l);
-            
-            return ptr->get_data(l);
-        }
+        vector<unsigned int> c(weights, weights + n);
+        for (size_t i = 1; i < n; i++)
+            c[i] += c[i - 1];
+        return c;
     }
-};
 
-typedef BinaryTree<frequency_t, word_list > word_tree;
+public:
+    Workload(size_t n, double z, double d, unsigned long long s)
+        :words(n), zipf(z), skip_depth(d), seed(s), state(s)
+    {
+        /// Per mille
+        static const unsigned int letter_weights[26] =
+            {82, 15, 28, 43, 127, 22, 20, 61, 70, 2, 8, 40, 24,
+             67, 75, 19, 1, 60, 63, 91, 28, 10, 24, 2, 20, 1};
+        /// Percents
+        static const unsigned int length_weights[14] =
+            {1, 2, 4, 8, 12, 15, 16, 14, 11, 8, 5, 3, 2, 1};
+        letters = accumulate(letter_weights, 26);
+        lengths = accumulate(length_weights, 14);
+    }
 
-/// Trie class to effectively store words under numerical keys as
-/// given by cell phone keyboard mapping. Words can be queried from
-/// trie by keys using Trie::query. Whenever a word is queried, its
-/// frequency is increased by one except it's a punctuation mark.
-class Trie
-{
-private:
-    /// Binary tree of words stored in root leaf of trie (sorted by
-    /// frequency)
-    word_tree words;
-
-    /// Children tries
-    vector<Trie*> children;
-    
-    /// Add word object under given full key
-    void add_word_proc(const Word &w, const frequency_t &freq = 500, level_t level = 0)
-    {
-        if (w.str[level] == '\0')
-            insert_word(words.get_data(freq), w);
-        else
-        {
-            vector<Trie*>::size_type key = char_keys[w.str[level] - 'a'] - '1';
-            if (children[key] == NULL)
-                children[key] = new Trie();
-            children[key]->add_word_proc(w, freq, level + 1);
-        }
+    size_t size(void) const
+    {
+        return words;
     }
 
-    /// Get list of words stored in trie under given full key. We
-    /// assume that all used words are present in the trie, so this
-    /// always succeeds.
-    word_tree& get_leaf(const char *full_key)
+    string word(size_t i) const
     {
-        vector<Trie*>::size_type key = (full_key[0] - '1');
-        if (*full_key == '\0')
-            return words;
-        else
-        {
-            return children[key]->get_leaf(full_key + 1);
-        }
+        unsigned long long x = seed * 0x100000001b3ULL + i;
+        string w(pick(lengths, splitmix(x)) + 1, ' ');
+        for (string::iterator c = w.begin(); c != w.end(); c++)
+            *c = 'a' + pick(letters, splitmix(x));
+        return w;
     }
-public:
-    Trie(void)
-        :words(500)
+
+    frequency_t frequency(size_t i) const
     {
-        /// Preallocate vector for 9 (from 1 to 9) children which may
-        /// be added later
-        children.resize(9, NULL);
+        return max(1.0, 1e6 / pow(i + 1, zipf));
     }
 
-    ~Trie(void)
+    static string key(const string &word)
     {
-        for (vector<Trie*>::iterator i = children.begin(); i != children.end(); i++)
-            if (*i != NULL)
-                delete *i;
+        string k(word);
+        for (string::iterator c = k.begin(); c != k.end(); c++)
+            *c = LatinLayout::key_chars[LatinLayout::keys[*c - 'a']];
+        return k;
     }
 
-    /// Public wrapper for add_word_proc
-    void add_word(const string &contents, const frequency_t &freq)
+    /// Add punctuation and all words to builder.
+    void fill(DictionaryBuilder<LatinLayout> &builder) const
     {
-        add_word_proc(Word(contents), freq);
+        builder.add_punctuation(".");
+        builder.add_punctuation(",");
+        builder.add_punctuation("?");
+        for (size_t i = 0; i < words; i++)
+            builder.add_word(word(i), frequency(i));
     }
 
-    /// Add new punctuation mark under 1
-    void add_punctuation(const string &punct)
+    /// Pick word to be queried next.
+    size_t next_word(void)
     {
-        if (children[0] == NULL)
-            children[0] = new Trie();
-        insert_word(children[0]->words.get_data(500), Word(punct, false));
+        double u = uniform();
+        double r;
+        if (fabs(zipf - 1) < 1e-9)
+            r = exp(u * log(words + 1.0));
+        else
+            r = pow((pow(words + 1.0, 1 - zipf) - 1) * u + 1, 1 / (1 - zipf));
+        return min<size_t>(r - 1, words - 1);
     }
 
-    /// Get n-th word stored in trie under given full key.
-    const Word& query(string &full_key, int n = 0)
+    /// Pick number of asterisks for key with given number of words.
+    int next_skips(unsigned int count)
     {
-        word_tree &t = get_leaf(full_key.c_str());
+        if (skip_depth <= 0)
+            return 0;
+        double p = 1 / (1 + skip_depth);
+        double k = floor(log(1 - uniform()) / log(1 - p));
+        return min<double>(k, count - 1);
+    }
 
-        /// *t_iter is a list of words with same frequency
-        word_tree::iterator t_iter = t.begin();
-        word_list::iterator w_iter, w_enditer;
+    /// Pick next query for dictionary built with fill.
+    void next_query(const Dictionary<LatinLayout> &dict, string &full_key, int &skips)
+    {
+        full_key = key(word(next_word()));
+        node_index_t v = 0;
+        dict.find_node(full_key.c_str(), v);
+        skips = next_skips(dict.node(v).count);
+    }
 
-        do
-        {
-            /// Skip to next non-empty frequency if needed.
-            while (!((*t_iter).size()))
-                t_iter++;
+    /// Print dictionary in input format followed by input line with
+    /// given number of words.
+    void generate(size_t queries, OutputSink &out)
+    {
+        Dictionary<LatinLayout> dict;
+        DictionaryBuilder<LatinLayout> builder;
+        vector<char> image;
+        fill(builder);
+        builder.build(image);
+        dict.load(image);
 
-            /// Begin iterating over words with this frequency
-            w_iter = (*t_iter).begin();
-            w_enditer = (*t_iter).end();
+        string line = to_string(words) + "\n";
+        out.write(line.data(), line.size());
+        for (size_t i = 0; i < words; i++)
+        {
+            line = word(i) + " " + to_string(frequency(i)) + "\n";
+            out.write(line.data(), line.size());
+        }
 
-            /// Try to skip n items (or less)
-            while ((w_iter != w_enditer) && n)
+        string full_key;
+        int skips;
+        for (size_t i = 0; i < queries; i++)
+        {
+            if (i > 0)
+                out.put(' ');
+            next_query(dict, full_key, skips);
+            out.write(full_key.data(), full_key.size());
+            for (; skips; skips--)
+                out.put('*');
+            /// Sometimes end sentence
+            if (uniform() < 0.05)
             {
-                w_iter++;
-                n--;
+                out.put(LatinLayout::key_chars[0]);
+                for (skips = next_skips(3); skips; skips--)
+                    out.put('*');
             }
-                
-            /// End of frequency reached?
-            if (w_iter == w_enditer)
-                t_iter++;
-            else
-                break;
         }
-        while (1);
+        out.put('\n');
+        out.flush();
+    }
+};
 
-        /// Bump frequency and reinsert word if needed
-        if (w_iter->bumpable)
-        {
-            Word w = Word(w_iter->str);
-            /// Remove old word entry
-            (*t_iter).erase(w_iter);
-            
-            w_iter = insert_word(t.get_data(t_iter.label() + 1), w, true);
-        }
+/// Collects operation latencies.
+class Latency
+{
+private:
+    vector<double> samples;
 
-        return *w_iter;
+public:
+    void add(double ns)
+    {
+        samples.push_back(ns);
+    }
+
+    /// Print count, mean and percentiles as JSON object.
+    void print(ostream &out)
+    {
+        double sum = 0;
+        for (vector<double>::iterator i = samples.begin(); i != samples.end(); i++)
+            sum += *i;
+        sort(samples.begin(), samples.end());
+        out << "{\"count\": " << samples.size();
+        if (!samples.empty())
+            out << ", \"mean\": " << sum / samples.size()
+                << ", \"p50\": " << samples[samples.size() / 2]
+                << ", \"p99\": " << samples[samples.size() * 99 / 100]
+                << ", \"max\": " << samples.back();
+        out << "}";
     }
 };
 
-class T9Reader
+typedef chrono::steady_clock bench_clock;
+
+double elapsed_ns(const bench_clock::time_point &since)
 {
-private:
-    string full_key;
-    bool prev_punct, word_put;
-    int skips;
-    Trie *trie;
+    return chrono::duration<double, nano>(bench_clock::now() - since).count();
+}
 
-    /// If word selected so far has not been printed yet, do it
-    void put_pending(void)
+/// Peak resident set size of process so far in kilobytes.
+long peak_rss_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/// Build dictionary of workload, run queries on it and print
+/// results as one JSON object. Reported latencies are in nanoseconds:
+///
+/// query         Trie::query
+/// first_bump    Trie::query moving word from dictionary to overlay
+/// rebump        Trie::query of word already bumped in this session
+/// complete      Trie::complete for random prefix of queried key
+/// reader        T9Reader per word of whole input line
+void run_benchmark(Workload &load, size_t queries, ostream &out)
+{
+    long rss_start = peak_rss_kb();
+
+    bench_clock::time_point start = bench_clock::now();
+    Dictionary<LatinLayout> dict;
+    DictionaryBuilder<LatinLayout> builder;
+    vector<char> image;
+    load.fill(builder);
+    builder.build(image);
+    size_t image_size = image.size();
+    dict.load(image);
+    double build_ns = elapsed_ns(start);
+    long rss_built = peak_rss_kb();
+
+    vector<string> keys(queries);
+    vector<int> skips(queries);
+    string line;
+    for (size_t i = 0; i < queries; i++)
     {
-        if (!word_put)
-            put_current_word();
+        load.next_query(dict, keys[i], skips[i]);
+        line += keys[i] + string(skips[i], '*') + ' ';
     }
 
-public:
-    T9Reader(Trie *t)
+    Latency query, first_bump, rebump, complete;
+    double reader_ns;
     {
-        trie = t;
-        full_key = "";
-        word_put = true;
-        prev_punct = false;
-        skips = 0;
+        Trie<LatinLayout> trie(dict);
+        unordered_set<const char*> bumped;
+        for (size_t i = 0; i < queries; i++)
+        {
+            start = bench_clock::now();
+            Word w = trie.query(keys[i], skips[i]);
+            double ns = elapsed_ns(start);
+            query.add(ns);
+            if (bumped.insert(w.str).second)
+                first_bump.add(ns);
+            else
+                rebump.add(ns);
+        }
+
+        vector<Word> words;
+        for (size_t i = 0; i < queries; i++)
+        {
+            string prefix = keys[i].substr(0, 1 + i % keys[i].size());
+            start = bench_clock::now();
+            trie.complete(prefix, 5, words);
+            complete.add(elapsed_ns(start));
+        }
     }
 
-    /// Print word selected so far
-    void put_current_word(void)
     {
-        trie->query(full_key, skips).print();
-        full_key.clear();
-        skips = 0;
-        word_put = true;
-        prev_punct = false;
+        string text;
+        OutputSink sink(&text);
+        T9Reader<LatinLayout> t9(dict, &sink);
+        start = bench_clock::now();
+        t9.read(line);
+        reader_ns = elapsed_ns(start) / max<size_t>(queries, 1);
     }
 
-    /// Read SMS input line with digits, spaces and asterisk signs and
-    /// print out words selected.
-    void read(const string &input)
+    out << "{\"words\": " << load.size()
+        << ", \"nodes\": " << dict.node_count()
+        << ", \"queries\": " << queries
+        << ", \"image_bytes\": " << image_size
+        << ", \"build_ms\": " << build_ns / 1e6
+        << ", \"query_ns\": ";
+    query.print(out);
+    out << ", \"first_bump_ns\": ";
+    first_bump.print(out);
+    out << ", \"rebump_ns\": ";
+    rebump.print(out);
+    out << ", \"complete_ns\": ";
+    complete.print(out);
+    out << ", \"reader_ns_per_word\": " << reader_ns
+        << ", \"rss_kb\": {\"start\": " << rss_start
+        << ", \"built\": " << rss_built
+        << ", \"peak\": " << peak_rss_kb() << "}}" << endl;
+}
+
+/// Read integer N for dictionary size. Then read N lines with words
+/// and initial frequencies and add them to builder.
+///
+/// @return false if some word is not typed with layout of builder or
+/// has no frequency, with number of its line (counting from 1) in
+/// bad_line.
+template <class Layout>
+bool read_dictionary(istream &in, DictionaryBuilder<Layout> &builder, size_t &bad_line)
+{
+    int dict_size;
+    string dict_word;
+    frequency_t freq;
+
+    in >> dict_size;
+
+    builder.add_punctuation(".");
+    builder.add_punctuation(",");
+    builder.add_punctuation("?");
+
+    for (int i = 0; i < dict_size; i++)
     {
-        for (string::const_iterator i = input.begin(); i != input.end(); i++)
+        in >> dict_word >> freq;
+        if (!in || !builder.add_word(dict_word, freq))
         {
-            if (*i == ' ')
+            bad_line = i + 2;
+            return false;
+        }
+    }
+    in.ignore(1);
+    return true;
+}
+
+/// Options of decoding run (see main).
+struct Options
+{
+    const char *image_path, *compile_path, *dictionary_path, *state_prefix;
+    const char *stats_format;
+    bool batch;
+    unsigned int threads;
+
+    Options(void)
+        :image_path(NULL), compile_path(NULL), dictionary_path(NULL),
+         state_prefix(NULL), stats_format(NULL), batch(false), threads(thread::hardware_concurrency())
+    {}
+};
+
+/// Read dictionary typed with given layout and decode SMS input.
+template <class Layout>
+int decode(const Options &opt)
+{
+    Dictionary<Layout> dict;
+
+    if (opt.image_path != NULL)
+    {
+        if (!dict.open(opt.image_path))
+        {
+            cerr << "Can't open dictionary image " << opt.image_path << endl;
+            return 1;
+        }
+    }
+    else
+    {
+        vector<char> image;
+
+        if (opt.dictionary_path != NULL)
+        {
+            MappedFile text;
+            size_t bad_line = 0;
+            if (!text.open(opt.dictionary_path) ||
+                !DictionaryParser<Layout>::build(text.data(), text.size(), image, opt.threads,
+                                                 bad_line))
             {
-                put_pending();
-                cout << ' ';
+                cerr << "Can't read dictionary " << opt.dictionary_path;
+                if (bad_line != 0)
+                    cerr << ": malformed line " << bad_line;
+                cerr << endl;
+                return 1;
             }
-            else
+        }
+        else
+        {
+            DictionaryBuilder<Layout> builder;
+            size_t bad_line = 0;
+            if (!read_dictionary(cin, builder, bad_line))
             {
-                /// Next character in word key
-                if ((*i >= '2') && (*i <= '9'))
-                {
-                    if (prev_punct)
-                        put_pending();
-                    full_key += *i;
-                    word_put = false;
-                }
-                else if (*i == '*')
-                    skips++;
-                /// Punctuation (put word)
-                else if (*i == '1')
-                {
-                    put_pending();
-                    full_key = "1";
-                    word_put = false;
-                    prev_punct = true;
-                }
+                cerr << "Can't read dictionary: malformed line " << bad_line << endl;
+                return 1;
             }
+            builder.build(image);
         }
-        put_pending();
+
+        if (opt.compile_path != NULL)
+        {
+            ofstream out(opt.compile_path, ios::binary);
+            out.write(&image[0], image.size());
+            if (!out)
+            {
+                cerr << "Can't write dictionary image " << opt.compile_path << endl;
+                return 1;
+            }
+            return 0;
+        }
+        dict.load(image);
     }
-};
 
-/// Read integer N for dictionary size. Then read N lines with words
-/// and initial frequencies. Then read input line with digits 1-9,
-/// asterisk signs and spaces and print out selected text.
+    if (opt.batch)
+    {
+        decode_lines(cin, dict, opt.threads);
+        return 0;
+    }
+
+    OutputSink out;
+    T9Reader<Layout> t9(dict, &out);
+    FrequencyStore<Layout> store(t9.get_trie());
+    if (opt.state_prefix != NULL)
+    {
+        if (!store.open(opt.state_prefix))
+        {
+            cerr << "Can't restore learned frequencies from " << opt.state_prefix << endl;
+            return 1;
+        }
+        t9.set_store(&store);
+    }
+
+    bool stats_json = (opt.stats_format != NULL) && !strcmp(opt.stats_format, "json");
+    if (opt.stats_format != NULL)
+    {
+        /// Interrupt blocking reads of input (see T9Reader::read), so
+        /// statistics are printed while waiting for it
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = request_stats;
+        sigaction(SIGUSR1, &action, NULL);
+        t9.report_stats(&cerr, stats_json);
+    }
+
+    /// Nothing has been read from standard input through cin if
+    /// dictionary is mapped or read from file, so read input directly.
+    if ((opt.image_path != NULL) || (opt.dictionary_path != NULL))
+        t9.read(0);
+    else
+        t9.read(cin, 0);
+
+    if (opt.stats_format != NULL)
+        t9.print_stats(cerr, stats_json);
+
+    if ((opt.state_prefix != NULL) && !store.checkpoint())
+    {
+        cerr << "Can't save learned frequencies to " << opt.state_prefix << endl;
+        return 1;
+    }
+    return 0;
+}
+
+/// Read dictionary as described in read_dictionary. Then read input
+/// line with digits 1-9, asterisk signs and spaces and print out
+/// selected text.
 ///
 /// Example input 1:
 /// 5
@@ -442,32 +3377,115 @@ public:
 ///
 /// Output:
 /// bat cat act bat.
+///
+/// Options:
+///
+/// --compile IMAGE  Only read dictionary and save its compiled image
+///                  to file.
+/// --image IMAGE    Map dictionary from compiled image and read only
+///                  SMS input.
+/// --layout NAME    Keypad layout of dictionary and SMS input: latin
+///                  (default) or cyrillic (Russian letters in UTF-8).
+///                  Images are tied to their layout.
+/// --dictionary FILE
+///                  Read dictionary from file instead of standard
+///                  input. File is parsed and compiled in parallel
+///                  (see DictionaryParser).
+/// --state PREFIX   Restore frequencies learned in previous runs from
+///                  PREFIX.snapshot and PREFIX.journal and keep
+///                  recording new ones there (see FrequencyStore).
+/// --stats FORMAT   Print statistics of decoding (see TrieStats and
+///                  ReaderStats) to standard error in text or json
+///                  format when input is over and whenever SIGUSR1
+///                  is received. Counters are only collected if
+///                  compiled with -DT9_STATS.
+/// --batch          Treat every input line as a separate session and
+///                  print one output line per input line. Sessions
+///                  are decoded in parallel.
+/// --threads N      Number of threads in batch mode (all cores by
+///                  default).
+///
+/// Benchmarking options (see Workload and run_benchmark):
+///
+/// --bench N        Run benchmark with synthetic dictionary of N
+///                  words and print results in JSON.
+/// --generate N     Print synthetic input with dictionary of N words.
+/// --queries Q      Number of queried words (100000 by default).
+/// --skip-depth D   Mean number of asterisks after key (1 by default).
+/// --zipf S         Zipf's law exponent (1 by default).
+/// --seed X         Random seed.
 
 int main(int argc, char* argv[])
 {
-    int dict_size;
-    string dict_word;
-    frequency_t freq;
-    Trie tr;
-    T9Reader t9 = T9Reader(&tr);
-    char buf[bufsize];
+    Options opt;
+    const char *layout = "latin";
+    size_t bench_words = 0, generate_words = 0, queries = 100000;
+    double skip_depth = 1, zipf = 1;
+    unsigned long long seed = 1;
 
-    cin >> dict_size;
+    ios::sync_with_stdio(false);
 
-    tr.add_punctuation(".");
-    tr.add_punctuation(",");
-    tr.add_punctuation("?");
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = (i + 1 < argc);
+        if (!strcmp(argv[i], "--image") && has_value)
+            opt.image_path = argv[++i];
+        else if (!strcmp(argv[i], "--compile") && has_value)
+            opt.compile_path = argv[++i];
+        else if (!strcmp(argv[i], "--dictionary") && has_value)
+            opt.dictionary_path = argv[++i];
+        else if (!strcmp(argv[i], "--layout") && has_value)
+            layout = argv[++i];
+        else if (!strcmp(argv[i], "--stats") && has_value)
+            opt.stats_format = argv[++i];
+        else if (!strcmp(argv[i], "--state") && has_value)
+            opt.state_prefix = argv[++i];
+        else if (!strcmp(argv[i], "--threads") && has_value)
+            opt.threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--batch"))
+            opt.batch = true;
+        else if (!strcmp(argv[i], "--bench") && has_value)
+            bench_words = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--generate") && has_value)
+            generate_words = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--queries") && has_value)
+            queries = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--skip-depth") && has_value)
+            skip_depth = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--zipf") && has_value)
+            zipf = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && has_value)
+            seed = strtoull(argv[++i], NULL, 10);
+        else
+        {
+            cerr << "Usage: " << argv[0]
+                 << " [--layout NAME] [--dictionary FILE] [--compile IMAGE | --image IMAGE]"
+                 << " [--state PREFIX] [--stats text|json] [--batch] [--threads N]" << endl
+                 << "       " << argv[0]
+                 << " --bench N | --generate N [--queries Q] [--skip-depth D]"
+                 << " [--zipf S] [--seed X]" << endl;
+            return 1;
+        }
+    }
 
-    /// Populate trie
-    for (int i = 0; i < dict_size; i++)
+    if (bench_words > 0)
+    {
+        Workload load(bench_words, zipf, skip_depth, seed);
+        run_benchmark(load, queries, cout);
+        return 0;
+    }
+    if (generate_words > 0)
     {
-        cin >> dict_word >> freq;
-        tr.add_word(dict_word, freq);
+        Workload load(generate_words, zipf, skip_depth, seed);
+        OutputSink out;
+        load.generate(queries, out);
+        return 0;
     }
 
-    cin.ignore(1);
-    cin.getline(buf, bufsize);
-    t9.read(buf);
-    
-    return 0;
+    if (!strcmp(layout, "latin"))
+        return decode<LatinLayout>(opt);
+    if (!strcmp(layout, "cyrillic"))
+        return decode<CyrillicLayout>(opt);
+    cerr << "Unknown layout " << layout << endl;
+    return 1;
 }